@@ -0,0 +1,508 @@
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <omp.h>
+
+#include "bvh.hpp"
+#include "camera.hpp"
+#include "frame_stats.hpp"
+#include "quantized_bvh.hpp"
+#include "raytrace.hpp"
+#include "tiny_stl.hpp"
+#include "vec4.hpp"
+
+// Same scale and expansion as the raytrace demo, so numbers are comparable
+constexpr float MESH_SCALE = 0.01f;
+constexpr float AABB_EXPANSION = 0.001f;
+constexpr int COHERENT_RAYS_WIDTH = 512;
+constexpr int COHERENT_RAYS_HEIGHT = 512;
+constexpr int NUM_INCOHERENT_RAYS = 1 << 18;
+
+struct BenchmarkOptions
+{
+    int num_warmups = 2;
+    int num_repetitions = 10;
+    int num_threads = 0;
+    std::vector<const char *> mesh_filepaths;
+};
+
+struct BenchmarkResult
+{
+    std::string mesh;
+    std::string name;
+    FrameTimeSummary summary;
+    // Zero for benchmarks that do not trace rays
+    size_t num_rays = 0;
+};
+
+struct RaySet
+{
+    std::vector<Vector4> origins, directions;
+    // Only used by shadow rays
+    std::vector<float> t_maxs;
+};
+
+struct TreeStatsResult
+{
+    std::string mesh;
+    std::string builder;
+    BVH::TreeStats stats;
+};
+
+static std::vector<BenchmarkResult> results;
+static std::vector<TreeStatsResult> tree_stats_results;
+// Rays whose hit differs between a quantized tree and its source tree, nonzero means rounding was not conservative
+static size_t num_quantized_mismatches = 0;
+
+static void run_benchmark(const BenchmarkOptions &options, const std::string &mesh, const std::string &name,
+                          size_t num_rays, const std::function<void()> &func)
+{
+    for (int i = 0; i < options.num_warmups; i++)
+    {
+        func();
+    }
+
+    std::vector<double> times_ms;
+    for (int i = 0; i < options.num_repetitions; i++)
+    {
+        auto t1 = std::chrono::steady_clock::now();
+        func();
+        auto t2 = std::chrono::steady_clock::now();
+        times_ms.push_back(std::chrono::duration<double, std::milli>(t2 - t1).count());
+    }
+
+    BenchmarkResult result{mesh, name, summarize_frame_times(times_ms), num_rays};
+    std::cerr << mesh << " / " << name << ": p50 " << result.summary.p50_ms << " ms, min " << result.summary.min_ms
+              << " ms";
+    if (num_rays > 0)
+    {
+        std::cerr << ", " << num_rays / (result.summary.p50_ms * 1000.0) << " Mrays/s";
+    }
+    std::cerr << std::endl;
+    results.push_back(result);
+}
+
+static std::vector<BVH::Triangle> make_sphere_mesh(int resolution, float radius)
+{
+    std::vector<BVH::Triangle> tris;
+    auto calc_point = [resolution, radius](int i, int j)
+    {
+        float theta = 3.14159265f * i / resolution;
+        float phi = 2 * 3.14159265f * j / resolution;
+        return Vector4(radius * std::sin(theta) * std::cos(phi), radius * std::sin(theta) * std::sin(phi),
+                       radius * std::cos(theta));
+    };
+    for (int i = 0; i < resolution; i++)
+    {
+        for (int j = 0; j < resolution; j++)
+        {
+            tris.push_back({calc_point(i, j), calc_point(i + 1, j), calc_point(i + 1, j + 1)});
+            tris.push_back({calc_point(i, j), calc_point(i + 1, j + 1), calc_point(i, j + 1)});
+        }
+    }
+    return tris;
+}
+
+// Random small triangles filling a cube, a worst case for ray coherence
+static std::vector<BVH::Triangle> make_triangle_soup(int num_tris, float size)
+{
+    std::mt19937 generator(1234);
+    std::uniform_real_distribution<float> position(-size, size);
+    std::uniform_real_distribution<float> offset(-size * 0.05f, size * 0.05f);
+    std::vector<BVH::Triangle> tris;
+    for (int i = 0; i < num_tris; i++)
+    {
+        Vector4 a(position(generator), position(generator), position(generator));
+        Vector4 b = a + Vector4(offset(generator), offset(generator), offset(generator));
+        Vector4 c = a + Vector4(offset(generator), offset(generator), offset(generator));
+        tris.push_back({a, b, c});
+    }
+    return tris;
+}
+
+static void write_tri_file(const char *filepath, const std::vector<BVH::Triangle> &tris, float scale)
+{
+    FILE *file = fopen(filepath, "w");
+    if (file == nullptr)
+    {
+        throw std::runtime_error("Failed to open file");
+    }
+    for (const auto &tri : tris)
+    {
+        for (const auto &v : tri.vertices)
+        {
+            fprintf(file, "%f %f %f ", v.x * scale, v.y * scale, v.z * scale);
+        }
+        fprintf(file, "\n");
+    }
+    fclose(file);
+}
+
+static void write_stl_file(const char *filepath, const std::vector<BVH::Triangle> &tris, float scale,
+                           Tiny_STL::File_Writer::Type type)
+{
+    auto writer = Tiny_STL::create_writer(filepath, type);
+    Tiny_STL::Triangle t;
+    for (const auto &tri : tris)
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            for (int j = 0; j < 3; j++)
+            {
+                t.vertices[i][j] = tri.vertices[i][j] * scale;
+            }
+        }
+        writer->write_triangle(&t);
+    }
+}
+
+// Primary rays of the demo's starting view
+static RaySet make_coherent_rays()
+{
+    Camera cam({0, -2, 0}, {0, 0, 0});
+    Vector4 up, right, forward;
+    cam.calc_vectors(&up, &right, &forward);
+    float tan_half_fov = std::tan(cam.get_fov() / 2);
+
+    RaySet rays;
+    for (int y = 0; y < COHERENT_RAYS_HEIGHT; y++)
+    {
+        for (int x = 0; x < COHERENT_RAYS_WIDTH; x++)
+        {
+            float px = 2 * (x / (float)COHERENT_RAYS_WIDTH) - 1;
+            float py = 1 - 2 * (y / (float)COHERENT_RAYS_HEIGHT);
+            Vector4 pixel_pos = cam.get_pos() + forward + right * tan_half_fov * px + up * tan_half_fov * py;
+            rays.origins.push_back(cam.get_pos());
+            rays.directions.push_back((pixel_pos - cam.get_pos()).normalized3());
+        }
+    }
+    return rays;
+}
+
+// Random origins inside the mesh bounds going in uniformly random directions
+static RaySet make_incoherent_rays(const BVH::AABB &aabb)
+{
+    std::mt19937 generator(5678);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    std::normal_distribution<float> normal(0.0f, 1.0f);
+
+    RaySet rays;
+    for (int i = 0; i < NUM_INCOHERENT_RAYS; i++)
+    {
+        Vector4 t(unit(generator), unit(generator), unit(generator));
+        rays.origins.push_back(aabb.lower + (aabb.upper - aabb.lower) * t);
+        Vector4 direction;
+        do
+        {
+            direction = Vector4(normal(generator), normal(generator), normal(generator));
+        } while (direction.length3() < 1e-6f);
+        rays.directions.push_back(direction.normalized3());
+    }
+    return rays;
+}
+
+// Rays from primary hit points towards a point light above and behind the camera
+static RaySet make_shadow_rays(const BVH::AABBTree &bvh, const RaySet &primary_rays)
+{
+    Vector4 light_pos(1, -3, 3);
+    RaySet rays;
+    for (size_t i = 0; i < primary_rays.origins.size(); i++)
+    {
+        float t;
+        if (!bvh.does_intersect_ray(primary_rays.origins[i], primary_rays.directions[i], &t))
+        {
+            continue;
+        }
+        Vector4 to_light = light_pos - (primary_rays.origins[i] + primary_rays.directions[i] * t);
+        float distance = to_light.length3();
+        Vector4 direction = to_light / distance;
+        // Start slightly off the surface to avoid hitting the triangle the ray starts on
+        Vector4 origin = primary_rays.origins[i] + primary_rays.directions[i] * t + direction * 1e-3f;
+        rays.origins.push_back(origin);
+        rays.directions.push_back(direction);
+        rays.t_maxs.push_back(distance);
+    }
+    return rays;
+}
+
+template <typename Tree>
+static size_t trace_closest_hits(const Tree &bvh, const RaySet &rays)
+{
+    int num_hits = 0;
+#pragma omp parallel for schedule(dynamic, 256) reduction(+ : num_hits)
+    for (int i = 0; i < (int)rays.origins.size(); i++)
+    {
+        float t;
+        num_hits += bvh.does_intersect_ray(rays.origins[i], rays.directions[i], &t);
+    }
+    return num_hits;
+}
+
+// Consecutive rays are traced together, which for the coherent set means 8 neighbouring pixels of a row
+static size_t trace_closest_hit_packets(const BVH::AABBTree &bvh, const RaySet &rays)
+{
+    int num_hits = 0;
+#pragma omp parallel for schedule(dynamic, 32) reduction(+ : num_hits)
+    for (int i = 0; i < (int)rays.origins.size() / BVH::RAY_PACKET_SIZE; i++)
+    {
+        BVH::RayPacket packet;
+        for (int j = 0; j < BVH::RAY_PACKET_SIZE; j++)
+        {
+            Vector4 origin = rays.origins[i * BVH::RAY_PACKET_SIZE + j];
+            Vector4 direction = rays.directions[i * BVH::RAY_PACKET_SIZE + j];
+            packet.origin_x[j] = origin.x;
+            packet.origin_y[j] = origin.y;
+            packet.origin_z[j] = origin.z;
+            packet.direction_x[j] = direction.x;
+            packet.direction_y[j] = direction.y;
+            packet.direction_z[j] = direction.z;
+        }
+        bvh.intersect_ray_packet(&packet);
+        for (int j = 0; j < BVH::RAY_PACKET_SIZE; j++)
+        {
+            num_hits += packet.t[j] < std::numeric_limits<float>::max();
+        }
+    }
+    return num_hits;
+}
+
+// Conservative bounds may only cost extra node visits, the closest hit must be exactly the same
+template <typename QuantizedTree>
+static size_t count_hit_mismatches(const BVH::AABBTree &bvh, const QuantizedTree &quantized_bvh, const RaySet &rays)
+{
+    int num_mismatches = 0;
+#pragma omp parallel for schedule(dynamic, 256) reduction(+ : num_mismatches)
+    for (int i = 0; i < (int)rays.origins.size(); i++)
+    {
+        float t, quantized_t;
+        bool hit = bvh.does_intersect_ray(rays.origins[i], rays.directions[i], &t);
+        bool quantized_hit = quantized_bvh.does_intersect_ray(rays.origins[i], rays.directions[i], &quantized_t);
+        num_mismatches += (hit != quantized_hit) || (hit && (t != quantized_t));
+    }
+    return num_mismatches;
+}
+
+template <typename QuantizedTree>
+static void run_quantized_benchmarks(const BenchmarkOptions &options, const std::string &mesh, const char *name,
+                                     const BVH::AABBTree &bvh, const RaySet &rays)
+{
+    QuantizedTree quantized_bvh(bvh);
+    size_t num_mismatches = count_hit_mismatches(bvh, quantized_bvh, rays);
+    if (num_mismatches > 0)
+    {
+        std::cerr << mesh << " / " << name << ": " << num_mismatches << " hits differ from the source tree"
+                  << std::endl;
+        num_quantized_mismatches += num_mismatches;
+    }
+    run_benchmark(options, mesh, name, rays.origins.size(), [&]()
+                  { trace_closest_hits(quantized_bvh, rays); });
+}
+
+static size_t trace_occlusion(const BVH::AABBTree &bvh, const RaySet &rays)
+{
+    int num_occluded = 0;
+#pragma omp parallel for schedule(dynamic, 256) reduction(+ : num_occluded)
+    for (int i = 0; i < (int)rays.origins.size(); i++)
+    {
+        num_occluded += bvh.is_ray_occluded(rays.origins[i], rays.directions[i], rays.t_maxs[i]);
+    }
+    return num_occluded;
+}
+
+static void run_mesh_benchmarks(const BenchmarkOptions &options, const std::string &mesh,
+                                const std::vector<BVH::Triangle> &tris)
+{
+    const char *build_names[] = {"build_variance", "build_spatial_split", "build_ploc", "build_variance_treelets",
+                                 "build_variance_reinsertion"};
+    BVH::BuildMethod build_methods[] = {BVH::BuildMethod::VARIANCE, BVH::BuildMethod::SPATIAL_SPLIT,
+                                        BVH::BuildMethod::PLOC, BVH::BuildMethod::VARIANCE,
+                                        BVH::BuildMethod::VARIANCE};
+    int treelet_passes[] = {0, 0, 0, 2, 0};
+    int reinsertion_passes[] = {0, 0, 0, 0, 2};
+    for (int i = 0; i < 5; i++)
+    {
+        BVH::BuildOptions build_options;
+        build_options.method = build_methods[i];
+        build_options.treelet_passes = treelet_passes[i];
+        build_options.reinsertion_passes = reinsertion_passes[i];
+        run_benchmark(options, mesh, build_names[i], 0, [&]()
+                      { BVH::AABBTree bvh(tris, AABB_EXPANSION, build_options); });
+
+        BVH::AABBTree bvh(tris, AABB_EXPANSION, build_options);
+        tree_stats_results.push_back({mesh, build_names[i], bvh.calc_stats()});
+    }
+
+    BVH::AABBTree bvh(tris, AABB_EXPANSION);
+    RaySet coherent_rays = make_coherent_rays();
+    RaySet incoherent_rays = make_incoherent_rays(bvh.get_aabb());
+    RaySet shadow_rays = make_shadow_rays(bvh, coherent_rays);
+
+    run_benchmark(options, mesh, "rays_coherent", coherent_rays.origins.size(), [&]()
+                  { trace_closest_hits(bvh, coherent_rays); });
+    run_benchmark(options, mesh, "rays_coherent_packets", coherent_rays.origins.size(), [&]()
+                  { trace_closest_hit_packets(bvh, coherent_rays); });
+    run_benchmark(options, mesh, "rays_incoherent", incoherent_rays.origins.size(), [&]()
+                  { trace_closest_hits(bvh, incoherent_rays); });
+    run_benchmark(options, mesh, "rays_shadow", shadow_rays.origins.size(), [&]()
+                  { trace_occlusion(bvh, shadow_rays); });
+
+    // Same tree with its nodes moved, only memory access patterns differ from rays_incoherent
+    const char *order_names[] = {"rays_incoherent_depth_first", "rays_incoherent_clustered"};
+    BVH::NodeOrder node_orders[] = {BVH::NodeOrder::DEPTH_FIRST, BVH::NodeOrder::SUBTREE_CLUSTERED};
+    for (int i = 0; i < 2; i++)
+    {
+        BVH::BuildOptions build_options;
+        build_options.node_order = node_orders[i];
+        BVH::AABBTree ordered_bvh(tris, AABB_EXPANSION, build_options);
+        run_benchmark(options, mesh, order_names[i], incoherent_rays.origins.size(), [&]()
+                      { trace_closest_hits(ordered_bvh, incoherent_rays); });
+    }
+
+    run_quantized_benchmarks<BVH::QuantizedAABBTree8>(options, mesh, "rays_coherent_quantized8", bvh, coherent_rays);
+    run_quantized_benchmarks<BVH::QuantizedAABBTree8>(options, mesh, "rays_incoherent_quantized8", bvh,
+                                                      incoherent_rays);
+    run_quantized_benchmarks<BVH::QuantizedAABBTree16>(options, mesh, "rays_coherent_quantized16", bvh,
+                                                       coherent_rays);
+    run_quantized_benchmarks<BVH::QuantizedAABBTree16>(options, mesh, "rays_incoherent_quantized16", bvh,
+                                                       incoherent_rays);
+}
+
+static void run_loading_benchmarks(const BenchmarkOptions &options, const std::string &mesh,
+                                   const std::vector<BVH::Triangle> &tris)
+{
+    // Round trip through temporary files in the working directory
+    std::string stl_binary_filepath = "bvh_bench_" + mesh + "_binary.stl";
+    std::string stl_ascii_filepath = "bvh_bench_" + mesh + "_ascii.stl";
+    std::string tri_filepath = "bvh_bench_" + mesh + ".tri";
+    write_stl_file(stl_binary_filepath.c_str(), tris, 1.0f / MESH_SCALE, Tiny_STL::File_Writer::Type::BINARY);
+    write_stl_file(stl_ascii_filepath.c_str(), tris, 1.0f / MESH_SCALE, Tiny_STL::File_Writer::Type::ASCII);
+    write_tri_file(tri_filepath.c_str(), tris, 1.0f / MESH_SCALE);
+
+    run_benchmark(options, mesh, "load_stl_binary", 0, [&]()
+                  { bvh_tris_from_stl_file(stl_binary_filepath.c_str(), MESH_SCALE); });
+    run_benchmark(options, mesh, "load_stl_ascii", 0, [&]()
+                  { bvh_tris_from_stl_file(stl_ascii_filepath.c_str(), MESH_SCALE); });
+    run_benchmark(options, mesh, "load_tri", 0, [&]()
+                  { bvh_tris_from_tri_file(tri_filepath.c_str(), MESH_SCALE); });
+
+    remove(stl_binary_filepath.c_str());
+    remove(stl_ascii_filepath.c_str());
+    remove(tri_filepath.c_str());
+}
+
+static bool parse_options(int argc, char *argv[], BenchmarkOptions *options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        bool has_value = (i + 1) < argc;
+        if ((strcmp(argv[i], "--warmup") == 0) && has_value)
+        {
+            options->num_warmups = atoi(argv[++i]);
+        }
+        else if ((strcmp(argv[i], "--reps") == 0) && has_value)
+        {
+            options->num_repetitions = atoi(argv[++i]);
+        }
+        else if ((strcmp(argv[i], "--threads") == 0) && has_value)
+        {
+            options->num_threads = atoi(argv[++i]);
+        }
+        else if (argv[i][0] != '-')
+        {
+            options->mesh_filepaths.push_back(argv[i]);
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return (options->num_warmups >= 0) && (options->num_repetitions > 0) && (options->num_threads >= 0);
+}
+
+static void write_results_json(const BenchmarkOptions &options)
+{
+    std::cout << "{\n";
+    std::cout << "  \"threads\": " << omp_get_max_threads() << ",\n";
+    std::cout << "  \"warmup\": " << options.num_warmups << ",\n";
+    std::cout << "  \"repetitions\": " << options.num_repetitions << ",\n";
+    std::cout << "  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const BenchmarkResult &result = results[i];
+        std::cout << "    {\"mesh\": \"" << escape_json(result.mesh) << "\", \"benchmark\": \"" << result.name
+                  << "\",\n";
+        write_frame_time_summary_json(std::cout, "time_ms", result.summary, "     ");
+        if (result.num_rays > 0)
+        {
+            std::cout << ",\n     \"rays\": " << result.num_rays
+                      << ", \"rays_per_second\": " << result.num_rays / (result.summary.p50_ms / 1000.0);
+        }
+        std::cout << "}" << ((i + 1 < results.size()) ? "," : "") << "\n";
+    }
+    std::cout << "  ],\n";
+    std::cout << "  \"tree_stats\": [\n";
+    for (size_t i = 0; i < tree_stats_results.size(); i++)
+    {
+        const TreeStatsResult &result = tree_stats_results[i];
+        const BVH::TreeStats &stats = result.stats;
+        std::cout << "    {\"mesh\": \"" << escape_json(result.mesh) << "\", \"builder\": \"" << result.builder << "\", "
+                  << "\"sah_cost\": " << stats.sah_cost << ", "
+                  << "\"epo\": " << stats.epo << ", "
+                  << "\"sibling_overlap\": " << stats.sibling_overlap << ", "
+                  << "\"nodes\": " << stats.num_nodes << ", "
+                  << "\"leaves\": " << stats.num_leaves << ", "
+                  << "\"tri_references\": " << stats.num_tri_references << ", "
+                  << "\"max_depth\": " << stats.max_depth << ", "
+                  << "\"avg_leaf_tris\": " << stats.avg_leaf_tris << ", "
+                  << "\"max_leaf_tris\": " << stats.max_leaf_tris << ", "
+                  << "\"nodes_memory\": " << stats.nodes_memory << "}"
+                  << ((i + 1 < tree_stats_results.size()) ? "," : "") << "\n";
+    }
+    std::cout << "  ]\n}" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    BenchmarkOptions options;
+    if (!parse_options(argc, argv, &options))
+    {
+        puts("Expected arguments: [--warmup N] [--reps N] [--threads N] [mesh.[stl|tri] ...]");
+        return 1;
+    }
+    if (options.num_threads > 0)
+    {
+        omp_set_num_threads(options.num_threads);
+    }
+
+    // Fixed synthetic meshes are always benchmarked, so runs without real meshes are still comparable
+    std::vector<BVH::Triangle> sphere = make_sphere_mesh(256, 1.0f);
+    std::vector<BVH::Triangle> soup = make_triangle_soup(50'000, 1.0f);
+    run_loading_benchmarks(options, "sphere", sphere);
+    run_mesh_benchmarks(options, "sphere", sphere);
+    run_mesh_benchmarks(options, "soup", soup);
+
+    for (const char *filepath : options.mesh_filepaths)
+    {
+        std::vector<BVH::Triangle> tris;
+        run_benchmark(options, filepath, "load", 0, [&]()
+                      { tris = load_bvh_tris_from_mesh_file(filepath, MESH_SCALE); });
+        run_mesh_benchmarks(options, filepath, tris);
+    }
+
+    write_results_json(options);
+    if (num_quantized_mismatches > 0)
+    {
+        std::cerr << num_quantized_mismatches << " rays hit differently in quantized trees" << std::endl;
+        return 1;
+    }
+    return 0;
+}
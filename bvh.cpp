@@ -1,20 +1,81 @@
+#include <algorithm>
 #include <iostream>
+#include <numeric>
+#include <stdexcept>
+#include <utility>
 
 #include "bvh.hpp"
+#include "incremental_update.hpp"
+#include "instancing.hpp"
+#include "node_order.hpp"
+#include "packet_traversal.hpp"
+#include "ploc.hpp"
+#include "quantization.hpp"
 #include "ray_intersection.hpp"
+#include "refit.hpp"
+#include "reinsertion_optimization.hpp"
+#include "spatial_split.hpp"
+#include "stats.hpp"
+#include "traversal_counters.hpp"
 #include "subdivision.hpp"
+#include "treelet_optimization.hpp"
 #include "utils.hpp"
 
 namespace BVH
 {
 
-    AABBTree::AABBTree(const std::vector<Triangle> &tris, float aabb_expansion) : tris(tris)
+#ifdef BVH_TRAVERSAL_COUNTERS
+    thread_local TraversalCounters thread_traversal_counters;
+    thread_local uint32_t thread_stack_depth = 0;
+#endif
+
+    TraversalCounters get_traversal_counters()
+    {
+#ifdef BVH_TRAVERSAL_COUNTERS
+        return thread_traversal_counters;
+#else
+        return TraversalCounters();
+#endif
+    }
+
+    void reset_traversal_counters()
+    {
+#ifdef BVH_TRAVERSAL_COUNTERS
+        thread_traversal_counters = TraversalCounters();
+#endif
+    }
+
+    AABBTree::AABBTree(const std::vector<Triangle> &tris, float aabb_expansion, const BuildOptions &options)
+        : tris(tris), tri_indices(tris.size()), num_input_tris(tris.size()), aabb_expansion(aabb_expansion),
+          options(options)
     {
-        preallocated_nodes = new Node[2 * tris.size()];
+        if (tris.empty())
+        {
+            throw std::invalid_argument("Triangles must not be empty");
+        }
+        if (options.max_depth < 0)
+        {
+            throw std::invalid_argument("Maximum depth must not be negative");
+        }
+        if (options.treelet_passes < 0)
+        {
+            throw std::invalid_argument("Number of treelet passes must not be negative");
+        }
+        if (options.reinsertion_passes < 0)
+        {
+            throw std::invalid_argument("Number of reinsertion passes must not be negative");
+        }
+        std::iota(tri_indices.begin(), tri_indices.end(), 0);
+
+        size_t max_num_references = tris.size();
+        if (options.method == BuildMethod::SPATIAL_SPLIT)
+        {
+            max_num_references += calc_max_spatial_split_duplicates(tris.size(), options.spatial_split_budget);
+        }
+        num_preallocated_nodes = 2 * max_num_references;
+        preallocated_nodes = new Node[num_preallocated_nodes];
 
-        root = new_node(this->tris.begin(), this->tris.end());
-        subdivide((Node *)root, aabb_expansion);
-        assert(count_leaf_triangles((Node *)root) == tris.size());
+        build();
     }
 
     AABBTree::~AABBTree()
@@ -22,16 +83,116 @@ namespace BVH
         delete[] preallocated_nodes;
     }
 
+    void AABBTree::build()
+    {
+        num_used_nodes = 0;
+        refit_levels.clear();
+
+        if (tris.size() != num_input_tris)
+        {
+            // Drop duplicate references left by a previous spatial split build
+            std::vector<Triangle> input(num_input_tris);
+            for (size_t i = 0; i < tris.size(); i++)
+            {
+                input[tri_indices[i]] = tris[i];
+            }
+            tris = std::move(input);
+            tri_indices.resize(num_input_tris);
+            std::iota(tri_indices.begin(), tri_indices.end(), 0);
+        }
+
+        switch (options.method)
+        {
+        case BuildMethod::VARIANCE:
+            VarianceBuilder(*this).build();
+            break;
+        case BuildMethod::SPATIAL_SPLIT:
+            SpatialSplitBuilder(*this).build();
+            break;
+        case BuildMethod::PLOC:
+            PlocBuilder(*this).build();
+            break;
+        }
+        assert((size_t)count_leaf_triangles((Node *)root) == tris.size());
+
+        // Optimizers only relink nodes, leaves need contiguous triangle ranges again afterwards
+        size_t num_changes = 0;
+        if (options.treelet_passes > 0)
+        {
+            num_changes += TreeletOptimizer(*this).optimize(options.treelet_passes, options.treelet_time_budget_ms);
+        }
+        if (options.reinsertion_passes > 0)
+        {
+            num_changes += ReinsertionOptimizer(*this).optimize(options.reinsertion_passes);
+        }
+        if (num_changes > 0)
+        {
+            relayout_tris();
+        }
+        NodeOrderer(*this).reorder(options.node_order);
+
+        built_sah_cost = calc_sah_cost(root);
+    }
+
     Node *AABBTree::new_node(std::vector<Triangle>::iterator begin, std::vector<Triangle>::iterator end)
     {
-        assert(num_used_nodes < (2 * tris.size()));
-        Node *node = preallocated_nodes + (num_used_nodes++);
+        int index = num_used_nodes++;
+        assert(index < num_preallocated_nodes);
+        Node *node = preallocated_nodes + index;
         node->begin = begin;
         node->end = end;
+        node->left = nullptr;
+        node->right = nullptr;
         return node;
     }
 
+    // Moves triangles into depth first leaf order, so that every node's triangles are a contiguous range again
+    // after a builder or optimizer combined leaves that were not adjacent
+    void AABBTree::relayout_tris()
+    {
+        std::vector<Triangle> old_tris = tris;
+        std::vector<uint32_t> old_tri_indices = tri_indices;
+        size_t next = 0;
+
+        // Second visit of an inner node, after both children are placed, closes its range
+        std::vector<std::pair<Node *, bool>> stack = {{root, false}};
+        while (!stack.empty())
+        {
+            Node *node = stack.back().first;
+            bool is_closing = stack.back().second;
+            stack.pop_back();
+            if (node->is_leaf())
+            {
+                size_t first = std::distance(tris.begin(), node->begin);
+                size_t count = std::distance(node->begin, node->end);
+                std::copy_n(old_tris.begin() + first, count, tris.begin() + next);
+                std::copy_n(old_tri_indices.begin() + first, count, tri_indices.begin() + next);
+                node->begin = tris.begin() + next;
+                node->end = node->begin + count;
+                next += count;
+            }
+            else if (is_closing)
+            {
+                node->begin = node->left->begin;
+                node->end = node->right->end;
+            }
+            else
+            {
+                stack.push_back({node, true});
+                stack.push_back({node->right, false});
+                stack.push_back({node->left, false});
+            }
+        }
+        assert(next == tris.size());
+    }
+
     bool AABBTree::does_intersect_ray(Vector4 origin, Vector4 direction, float *t_out) const
+    {
+        BVH_COUNT(num_rays);
+        return does_intersect_ray_uncounted(origin, direction, t_out);
+    }
+
+    bool AABBTree::does_intersect_ray_uncounted(Vector4 origin, Vector4 direction, float *t_out) const
     {
         Ray ray(origin, direction);
         intersect_ray_bvh(ray, (Node *)root);
@@ -39,10 +200,69 @@ namespace BVH
         return ray.get_t() < std::numeric_limits<float>::max();
     }
 
+    bool AABBTree::does_intersect_ray(Vector4 origin, Vector4 direction, float *t_out, Vector4 *normal_out) const
+    {
+        Ray ray(origin, direction);
+        BVH_COUNT(num_rays);
+        intersect_ray_bvh(ray, (Node *)root);
+        *t_out = ray.get_t();
+        if (ray.get_hit_triangle() == nullptr)
+        {
+            return false;
+        }
+        *normal_out = calc_facing_normal(*ray.get_hit_triangle(), direction);
+        return true;
+    }
+
+    bool AABBTree::is_ray_occluded(Vector4 origin, Vector4 direction, float t_max) const
+    {
+        Ray ray(origin, direction);
+        BVH_COUNT(num_rays);
+        return is_ray_occluded_bvh(ray, (Node *)root, t_max);
+    }
+
+    const AABB &AABBTree::get_aabb() const
+    {
+        return root->aabb;
+    }
+
     void AABBTree::print_stats() const
     {
-        std::cout << "Num. BVH triangles = " << tris.size() << std::endl;
-        std::cout << "Num. BVH leaf nodes = " << count_leaf_nodes((Node *)root) << std::endl;
+        TreeStats stats = calc_stats();
+        std::cout << "Num. BVH triangles = " << stats.num_tris << std::endl;
+        if (stats.num_tri_references != stats.num_tris)
+        {
+            std::cout << "Num. BVH triangle references = " << stats.num_tri_references << std::endl;
+        }
+        std::cout << "Num. BVH nodes = " << stats.num_nodes << std::endl;
+        std::cout << "Num. BVH leaf nodes = " << stats.num_leaves << std::endl;
+        std::cout << "BVH max depth = " << stats.max_depth << std::endl;
+        std::cout << "BVH leaf triangles: avg = " << stats.avg_leaf_tris << ", max = " << stats.max_leaf_tris
+                  << std::endl;
+        std::cout << "BVH SAH cost = " << stats.sah_cost << std::endl;
+        std::cout << "BVH sibling overlap = " << stats.sibling_overlap << std::endl;
+        std::cout << "BVH EPO = " << stats.epo << std::endl;
+        std::cout << "BVH nodes memory = " << stats.nodes_memory << " bytes" << std::endl;
+
+        std::cout << "BVH leaf depth histogram:";
+        for (size_t depth = 0; depth < stats.depth_histogram.size(); depth++)
+        {
+            if (stats.depth_histogram[depth] > 0)
+            {
+                std::cout << " " << depth << ":" << stats.depth_histogram[depth];
+            }
+        }
+        std::cout << std::endl;
+
+        std::cout << "BVH leaf size histogram:";
+        for (size_t size = 0; size < stats.leaf_size_histogram.size(); size++)
+        {
+            if (stats.leaf_size_histogram[size] > 0)
+            {
+                std::cout << " " << size << ":" << stats.leaf_size_histogram[size];
+            }
+        }
+        std::cout << std::endl;
     }
 
 }
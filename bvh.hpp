@@ -1,13 +1,19 @@
 #pragma once
 
+#include <atomic>
+#include <cstdint>
 #include <vector>
 
 #include "non_copyable.hpp"
+#include "traversal_counters.hpp"
 #include "vec4.hpp"
 
 namespace BVH
 {
 
+    template <typename T>
+    class QuantizedAABBTree;
+
     struct Triangle
     {
         Vector4 vertices[3];
@@ -23,6 +29,21 @@ namespace BVH
         Vector4 upper, lower;
     };
 
+    // Number of rays traced together by AABBTree::intersect_ray_packet
+    constexpr int RAY_PACKET_SIZE = 8;
+
+    // Rays in structure of arrays layout, so that they can be generated and tested against boxes 8 at a time
+    struct RayPacket
+    {
+        float origin_x[RAY_PACKET_SIZE], origin_y[RAY_PACKET_SIZE], origin_z[RAY_PACKET_SIZE];
+        float direction_x[RAY_PACKET_SIZE], direction_y[RAY_PACKET_SIZE], direction_z[RAY_PACKET_SIZE];
+        // Closest hit distance of each ray, written by AABBTree::intersect_ray_packet,
+        // std::numeric_limits<float>::max() for rays that hit nothing
+        float t[RAY_PACKET_SIZE];
+        // Unit normal of the hit triangle facing the ray's origin, only written for rays that hit something
+        float normal_x[RAY_PACKET_SIZE], normal_y[RAY_PACKET_SIZE], normal_z[RAY_PACKET_SIZE];
+    };
+
     struct Node
     {
         std::vector<Triangle>::iterator begin, end;
@@ -45,25 +66,143 @@ namespace BVH
         }
     };
 
+    enum class BuildMethod
+    {
+        // Splits at the centroid mean along the axis of largest centroid variance
+        VARIANCE,
+        // SAH builder that may also split space itself, clipping triangles that straddle the split plane
+        // and referencing them from both sides, reduces node overlap on meshes with long thin triangles
+        SPATIAL_SPLIT,
+        // Agglomerative builder merging nearest neighbour clusters bottom-up, slower to build than VARIANCE,
+        // with lower SAH cost on finely tessellated surfaces but not on scattered triangles
+        PLOC,
+    };
+
+    // Placement of nodes in memory after the build, traversal results are the same for all of them
+    enum class NodeOrder
+    {
+        // Order in which the builder allocated nodes, siblings are adjacent but subtrees are spread out
+        ALLOCATION,
+        // Depth first with the larger child of every node right after it
+        DEPTH_FIRST,
+        // Subtrees packed into 4 KiB pages top-down, so that rays touch fewer pages on the way down
+        SUBTREE_CLUSTERED,
+    };
+
+    struct BuildOptions
+    {
+        BuildMethod method = BuildMethod::VARIANCE;
+        // Maximum number of extra triangle references created by spatial splits, relative to the number of triangles
+        float spatial_split_budget = 0.3f;
+        // Nodes at this depth become leaves whatever their size, so that degenerate meshes,
+        // e.g. with many coincident centroids, cannot produce arbitrarily deep trees
+        int max_depth = 64;
+        // Treelet restructuring passes run after any builder, each rewrites treelets of up to 7 leaves all over the
+        // tree into their SAH-optimal topology, trading build time for trace speed, zero disables the optimizer
+        int treelet_passes = 0;
+        // Stops treelet passes early once they took this long, zero for no limit
+        float treelet_time_budget_ms = 0.0f;
+        // Reinsertion passes run after treelet restructuring, each removes the 5% of inner nodes whose children are
+        // the farthest apart and inserts the children back where they cost the least, passes stop early once they
+        // no longer lower the SAH cost, zero disables the optimizer
+        int reinsertion_passes = 0;
+        NodeOrder node_order = NodeOrder::ALLOCATION;
+    };
+
+    struct TreeStats
+    {
+        size_t num_tris = 0;
+        // Larger than num_tris when spatial splits duplicated triangles
+        size_t num_tri_references = 0;
+        size_t num_nodes = 0;
+        size_t num_leaves = 0;
+        size_t max_depth = 0;
+        // Bytes allocated for nodes, including preallocated ones that the builder did not use
+        size_t nodes_memory = 0;
+        float avg_leaf_tris = 0.0f;
+        size_t max_leaf_tris = 0;
+        // Relative to the root's surface area, with unit traversal and intersection costs
+        float sah_cost = 0.0f;
+        // Sum of the surface areas of the overlap between siblings, relative to the root's surface area
+        float sibling_overlap = 0.0f;
+        // Effective parallel overlap (Aila et al. 2013): area of triangles lying inside nodes that do not
+        // reference them, summed over all nodes and relative to the total triangle area
+        float epo = 0.0f;
+        // Number of leaves at each depth
+        std::vector<size_t> depth_histogram;
+        // Number of leaves with each triangle count
+        std::vector<size_t> leaf_size_histogram;
+    };
+
     class AABBTree : public NonCopyable
     {
+        template <typename T>
+        friend class QuantizedAABBTree;
+        friend class SpatialSplitBuilder;
+        friend class VarianceBuilder;
+        friend class PlocBuilder;
+        friend class TreeletOptimizer;
+        friend class ReinsertionOptimizer;
+        friend class NodeOrderer;
+        friend class TopLevelAABBTree;
 
     private:
         std::vector<Triangle> tris;
+        // Index of each triangle in the array originally passed to the constructor,
+        // kept in sync as the builder reorders tris
+        std::vector<uint32_t> tri_indices;
         Node *root = nullptr;
         Node *preallocated_nodes = nullptr;
-        int num_used_nodes = 0;
+        int num_preallocated_nodes = 0;
+        // Atomic since the builder allocates nodes from several threads
+        std::atomic<int> num_used_nodes{0};
+        size_t num_input_tris;
+        float aabb_expansion;
+        BuildOptions options;
+        float built_sah_cost = 0.0f;
+        // Nodes grouped by depth, computed on first refit and reused while topology stays the same
+        std::vector<std::vector<Node *>> refit_levels;
 
         Node *new_node(std::vector<Triangle>::iterator begin, std::vector<Triangle>::iterator end);
-        void subdivide(Node *, float);
+        void build();
+        void relayout_tris();
+        void calc_refit_levels();
+        float calc_epo() const;
+        // Same as does_intersect_ray but not counted as a ray, for queries nested in a TopLevelAABBTree ray
+        bool does_intersect_ray_uncounted(Vector4 origin, Vector4 direction, float *t_out) const;
 
     public:
-        explicit AABBTree(const std::vector<Triangle> &tris, float aabb_expansion);
+        explicit AABBTree(const std::vector<Triangle> &tris, float aabb_expansion,
+                          const BuildOptions &options = BuildOptions());
 
         ~AABBTree();
 
         bool does_intersect_ray(Vector4 origin, Vector4 direction, float *t_out) const;
 
+        // Also returns the unit normal of the hit triangle, facing the ray's origin, for shading and spawning secondary rays
+        bool does_intersect_ray(Vector4 origin, Vector4 direction, float *t_out, Vector4 *normal_out) const;
+
+        // Finds the closest hit of every ray in the packet, traversing the tree once for all of them,
+        // faster than single ray queries when the rays are coherent, e.g. primary rays of neighbouring pixels
+        void intersect_ray_packet(RayPacket *packet) const;
+
+        // Returns true if any triangle is hit at a distance in [0, t_max[, cheaper than finding the closest hit,
+        // meant for shadow and occlusion rays
+        bool is_ray_occluded(Vector4 origin, Vector4 direction, float t_max) const;
+
+        const AABB &get_aabb() const;
+
+        // Replaces triangle positions, tris must have the same size and order as the array passed to the constructor,
+        // node bounds are stale until refit() is called
+        void update_vertices(const std::vector<Triangle> &tris);
+
+        // Recomputes node bounds bottom-up keeping the current topology,
+        // if rebuild_threshold is positive and SAH cost grew by more than that factor since the last build,
+        // the tree is rebuilt from scratch instead, returns true when a rebuild happened
+        bool refit(float rebuild_threshold = 0.0f);
+
+        TreeStats calc_stats() const;
+
         void print_stats() const;
     };
 
@@ -46,6 +46,28 @@ public:
         return pos;
     }
 
+    void set_pos(Vector4 new_pos)
+    {
+        pos = new_pos;
+    }
+
+    // Rotations relative to the orientation the camera was constructed with
+    float get_yaw() const
+    {
+        return yaw;
+    }
+
+    float get_pitch() const
+    {
+        return pitch;
+    }
+
+    void set_rotation(float new_yaw, float new_pitch)
+    {
+        yaw = new_yaw;
+        pitch = new_pitch;
+    }
+
     void rotate(float d_yaw, float d_pitch)
     {
         yaw -= d_yaw;
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdio>
+#include <stdexcept>
+#include <vector>
+
+#include "camera.hpp"
+#include "vec4.hpp"
+
+// Camera state of one frame, yaw and pitch are relative to the orientation the camera was constructed with
+struct CameraPose
+{
+    Vector4 pos;
+    float yaw, pitch;
+};
+
+CameraPose get_camera_pose(const Camera &camera)
+{
+    return {camera.get_pos(), camera.get_yaw(), camera.get_pitch()};
+}
+
+void set_camera_pose(Camera *camera, const CameraPose &pose)
+{
+    camera->set_pos(pose.pos);
+    camera->set_rotation(pose.yaw, pose.pitch);
+}
+
+// One frame per line as "x y z yaw pitch", printed with enough digits to replay the exact same floats
+void write_camera_path(const char *filepath, const std::vector<CameraPose> &poses)
+{
+    FILE *file = fopen(filepath, "w");
+    if (file == NULL)
+    {
+        throw std::runtime_error("Failed to open file");
+    }
+    for (const auto &pose : poses)
+    {
+        fprintf(file, "%.9g %.9g %.9g %.9g %.9g\n", pose.pos.x, pose.pos.y, pose.pos.z, pose.yaw, pose.pitch);
+    }
+    fclose(file);
+}
+
+std::vector<CameraPose> read_camera_path(const char *filepath)
+{
+    FILE *file = fopen(filepath, "r");
+    if (file == NULL)
+    {
+        throw std::runtime_error("Failed to open file");
+    }
+    std::vector<CameraPose> poses;
+    float x, y, z, yaw, pitch;
+    while (fscanf(file, "%f %f %f %f %f\n", &x, &y, &z, &yaw, &pitch) == 5)
+    {
+        poses.push_back({Vector4(x, y, z), yaw, pitch});
+    }
+    bool is_complete = feof(file);
+    fclose(file);
+    if (!is_complete || poses.empty())
+    {
+        throw std::runtime_error("Invalid camera path file");
+    }
+    return poses;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <utility>
+
+#include "bvh.hpp"
+#include "vec4.hpp"
+
+namespace BVH
+{
+
+    // A triangle clipped by the 6 planes of a box gains at most one vertex per plane
+    constexpr int MAX_CLIPPED_POLYGON_VERTICES = 9;
+
+    // Sutherland-Hodgman clipping of a triangle against an axis aligned box,
+    // returns the number of vertices written to polygon, zero when the triangle is outside the box
+    int clip_triangle_to_aabb(const Triangle &tri, const AABB &aabb, Vector4 polygon[MAX_CLIPPED_POLYGON_VERTICES])
+    {
+        Vector4 buffer[MAX_CLIPPED_POLYGON_VERTICES];
+        Vector4 *input = polygon;
+        Vector4 *output = buffer;
+        for (int i = 0; i < 3; i++)
+        {
+            input[i] = tri.vertices[i];
+        }
+        int num_vertices = 3;
+
+        for (int axis = 0; axis < 3; axis++)
+        {
+            for (int side = 0; side < 2; side++)
+            {
+                float bound = (side == 0) ? aabb.lower[axis] : aabb.upper[axis];
+                auto is_inside = [axis, side, bound](const Vector4 &v)
+                { return (side == 0) ? (v[axis] >= bound) : (v[axis] <= bound); };
+
+                int num_output = 0;
+                for (int i = 0; i < num_vertices; i++)
+                {
+                    const Vector4 &p = input[i];
+                    const Vector4 &q = input[(i + 1) % num_vertices];
+                    bool is_p_inside = is_inside(p);
+                    if (is_p_inside)
+                    {
+                        output[num_output++] = p;
+                    }
+                    if (is_p_inside != is_inside(q))
+                    {
+                        float t = (bound - p[axis]) / (q[axis] - p[axis]);
+                        Vector4 intersection = p + (q - p) * t;
+                        // Snap to the plane so rounding cannot leave the point slightly outside
+                        intersection[axis] = bound;
+                        output[num_output++] = intersection;
+                    }
+                }
+
+                num_vertices = num_output;
+                if (num_vertices == 0)
+                {
+                    return 0;
+                }
+                std::swap(input, output);
+            }
+        }
+
+        // After an even number of passes the result is back in polygon
+        return num_vertices;
+    }
+
+    AABB calc_polygon_aabb(const Vector4 *polygon, int num_vertices)
+    {
+        AABB aabb;
+        aabb.upper = aabb.lower = polygon[0];
+        for (int i = 1; i < num_vertices; i++)
+        {
+            aabb.upper = aabb.upper.max(polygon[i]);
+            aabb.lower = aabb.lower.min(polygon[i]);
+        }
+        return aabb;
+    }
+
+    float calc_polygon_area(const Vector4 *polygon, int num_vertices)
+    {
+        Vector4 sum;
+        for (int i = 1; i + 1 < num_vertices; i++)
+        {
+            sum = sum + (polygon[i] - polygon[0]).cross3(polygon[i + 1] - polygon[0]);
+        }
+        return 0.5f * sum.length3();
+    }
+
+}
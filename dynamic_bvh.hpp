@@ -0,0 +1,72 @@
+#pragma once
+
+#include <vector>
+
+#include "bvh.hpp"
+#include "non_copyable.hpp"
+#include "vec4.hpp"
+
+namespace BVH
+{
+
+    struct DynamicNode
+    {
+        AABB aabb;
+        // Doubles as the next free node while the node is in the free list
+        int parent = -1;
+        int left = -1, right = -1;
+        // Triangle slot referenced by leaves
+        int tri = -1;
+
+        bool is_leaf() const
+        {
+            return left == -1;
+        }
+    };
+
+    // Incrementally updated tree with one triangle per leaf,
+    // insertion picks the sibling with the lowest SAH cost increase (branch and bound),
+    // removal collapses the leaf's parent into its sibling,
+    // and tree rotations along the updated path keep quality from degrading over many edits
+    class DynamicAABBTree : public NonCopyable
+    {
+    private:
+        std::vector<DynamicNode> nodes;
+        int root = -1;
+        int free_node = -1;
+
+        std::vector<Triangle> tris;
+        // Leaf node of each triangle slot, -1 for free slots
+        std::vector<int> tri_leaves;
+        std::vector<int> free_tris;
+        float aabb_expansion;
+
+        int allocate_node();
+        void release_node(int index);
+        int find_best_sibling(const AABB &aabb) const;
+        void insert_leaf(int leaf);
+        void remove_leaf(int leaf);
+        void replace_child(int parent, int old_child, int new_child);
+        void rotate(int index);
+        void refit_ancestors(int index);
+
+    public:
+        explicit DynamicAABBTree(float aabb_expansion);
+
+        // Returns a handle that stays valid until the triangle is removed
+        int insert(const Triangle &tri);
+
+        void remove(int handle);
+
+        const Triangle &get_triangle(int handle) const;
+
+        size_t size() const;
+
+        bool does_intersect_ray(Vector4 origin, Vector4 direction, float *t_out) const;
+
+        float calc_sah_cost() const;
+
+        void print_stats() const;
+    };
+
+}
@@ -0,0 +1,181 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Time spent in each stage of one frame, in milliseconds
+struct FrameTimings
+{
+    // Ray generation and tracing, which includes shading, are interleaved tile by tile on all threads,
+    // these are the time each thread spent in the stage averaged over threads
+    double raygen_ms = 0.0;
+    double trace_ms = 0.0;
+    // Texture upload and presentation, zero in headless mode
+    double present_ms = 0.0;
+    // Wall time of the frame, in interactive mode the interval between two presents
+    double total_ms = 0.0;
+};
+
+struct FrameTimeSummary
+{
+    double total_ms = 0.0;
+    double mean_ms = 0.0;
+    double min_ms = 0.0;
+    double p50_ms = 0.0;
+    double p90_ms = 0.0;
+    double p95_ms = 0.0;
+    double p99_ms = 0.0;
+    double max_ms = 0.0;
+};
+
+// Linear interpolation between closest ranks, sorted_values must not be empty
+double calc_percentile(const std::vector<double> &sorted_values, double percentile)
+{
+    double rank = percentile / 100.0 * (sorted_values.size() - 1);
+    size_t lower = static_cast<size_t>(std::floor(rank));
+    size_t upper = std::min(lower + 1, sorted_values.size() - 1);
+    double fraction = rank - lower;
+    return sorted_values[lower] + (sorted_values[upper] - sorted_values[lower]) * fraction;
+}
+
+FrameTimeSummary summarize_frame_times(std::vector<double> frame_times_ms)
+{
+    FrameTimeSummary summary;
+    if (frame_times_ms.empty())
+    {
+        return summary;
+    }
+
+    std::sort(frame_times_ms.begin(), frame_times_ms.end());
+    for (double t : frame_times_ms)
+    {
+        summary.total_ms += t;
+    }
+    summary.mean_ms = summary.total_ms / frame_times_ms.size();
+    summary.min_ms = frame_times_ms.front();
+    summary.p50_ms = calc_percentile(frame_times_ms, 50);
+    summary.p90_ms = calc_percentile(frame_times_ms, 90);
+    summary.p95_ms = calc_percentile(frame_times_ms, 95);
+    summary.p99_ms = calc_percentile(frame_times_ms, 99);
+    summary.max_ms = frame_times_ms.back();
+    return summary;
+}
+
+std::string escape_json(const std::string &str)
+{
+    std::string result;
+    for (char c : str)
+    {
+        if ((c == '"') || (c == '\\'))
+        {
+            result += '\\';
+        }
+        result += c;
+    }
+    return result;
+}
+
+void write_json_array(std::ostream &out, const std::vector<double> &values)
+{
+    out << "[";
+    for (size_t i = 0; i < values.size(); i++)
+    {
+        out << (i ? ", " : "") << values[i];
+    }
+    out << "]";
+}
+
+void write_frame_time_summary_json(std::ostream &out, const char *key, const FrameTimeSummary &summary,
+                                   const char *indent)
+{
+    out << indent << "\"" << key << "\": {"
+        << "\"mean\": " << summary.mean_ms << ", "
+        << "\"min\": " << summary.min_ms << ", "
+        << "\"p50\": " << summary.p50_ms << ", "
+        << "\"p90\": " << summary.p90_ms << ", "
+        << "\"p95\": " << summary.p95_ms << ", "
+        << "\"p99\": " << summary.p99_ms << ", "
+        << "\"max\": " << summary.max_ms << "}";
+}
+
+std::vector<double> get_stage_times(const std::vector<FrameTimings> &timings, double FrameTimings::*stage_ms)
+{
+    std::vector<double> times_ms;
+    times_ms.reserve(timings.size());
+    for (const FrameTimings &frame : timings)
+    {
+        times_ms.push_back(frame.*stage_ms);
+    }
+    return times_ms;
+}
+
+// Number of frames in each power of two bucket, [0, 1[ ms, [1, 2[ ms, [2, 4[ ms and so on,
+// trailing buckets are only present up to the slowest frame
+std::vector<size_t> calc_frame_time_histogram(const std::vector<double> &frame_times_ms)
+{
+    std::vector<size_t> histogram;
+    for (double t : frame_times_ms)
+    {
+        size_t bucket = 0;
+        for (double upper_ms = 1.0; t >= upper_ms; upper_ms *= 2)
+        {
+            bucket++;
+        }
+        if (bucket >= histogram.size())
+        {
+            histogram.resize(bucket + 1, 0);
+        }
+        histogram[bucket]++;
+    }
+    return histogram;
+}
+
+// Buckets are written as {"upper": bound in ms, "frames": count}
+void write_frame_time_histogram_json(std::ostream &out, const char *key, const std::vector<size_t> &histogram,
+                                     const char *indent)
+{
+    out << indent << "\"" << key << "\": [";
+    double upper_ms = 1.0;
+    for (size_t i = 0; i < histogram.size(); i++, upper_ms *= 2)
+    {
+        out << (i ? ", " : "") << "{\"upper\": " << upper_ms << ", \"frames\": " << histogram[i] << "}";
+    }
+    out << "]";
+}
+
+// Summaries of every stage and a histogram of total frame times, as members of an enclosing JSON object
+void write_frame_timings_json(std::ostream &out, const std::vector<FrameTimings> &timings, const char *indent)
+{
+    std::vector<double> total_ms = get_stage_times(timings, &FrameTimings::total_ms);
+    write_frame_time_summary_json(out, "frame_ms", summarize_frame_times(total_ms), indent);
+    out << ",\n";
+    write_frame_time_summary_json(out, "raygen_ms", summarize_frame_times(get_stage_times(timings, &FrameTimings::raygen_ms)), indent);
+    out << ",\n";
+    write_frame_time_summary_json(out, "trace_ms", summarize_frame_times(get_stage_times(timings, &FrameTimings::trace_ms)), indent);
+    out << ",\n";
+    write_frame_time_summary_json(out, "present_ms", summarize_frame_times(get_stage_times(timings, &FrameTimings::present_ms)), indent);
+    out << ",\n";
+    write_frame_time_histogram_json(out, "frame_ms_histogram", calc_frame_time_histogram(total_ms), indent);
+}
+
+// One row per frame, for plotting frame time over a run
+void write_frame_timings_csv(const char *filepath, const std::vector<FrameTimings> &timings)
+{
+    FILE *file = fopen(filepath, "w");
+    if (file == NULL)
+    {
+        throw std::runtime_error("Failed to open file");
+    }
+    fprintf(file, "frame,raygen_ms,trace_ms,present_ms,total_ms\n");
+    for (size_t i = 0; i < timings.size(); i++)
+    {
+        const FrameTimings &frame = timings[i];
+        fprintf(file, "%zu,%.4f,%.4f,%.4f,%.4f\n", i, frame.raygen_ms, frame.trace_ms, frame.present_ms, frame.total_ms);
+    }
+    fclose(file);
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cctype>
+#include <cstdio>
+#include <stdexcept>
+#include <vector>
+
+// Channel order matches SDL_PIXELFORMAT_RGBA8888 on little endian machines
+struct Color
+{
+    unsigned char a, b, g, r;
+};
+
+// Writes pixels as a binary PPM (P6) image, alpha is dropped
+void write_ppm(const char *filepath, const Color *pixels, int width, int height)
+{
+    FILE *file = fopen(filepath, "wb");
+    if (file == NULL)
+    {
+        throw std::runtime_error("Failed to open file");
+    }
+    fprintf(file, "P6\n%d %d\n255\n", width, height);
+    for (int i = 0; i < width * height; i++)
+    {
+        unsigned char rgb[3] = {pixels[i].r, pixels[i].g, pixels[i].b};
+        fwrite(rgb, 1, 3, file);
+    }
+    fclose(file);
+}
+
+// Reads the next whitespace separated number of a PPM header, skipping # comments
+static int read_ppm_header_value(FILE *file)
+{
+    int c = fgetc(file);
+    while ((c != EOF) && (isspace(c) || (c == '#')))
+    {
+        if (c == '#')
+        {
+            while ((c != EOF) && (c != '\n'))
+            {
+                c = fgetc(file);
+            }
+        }
+        c = fgetc(file);
+    }
+
+    int value = 0;
+    bool has_digits = false;
+    while ((c != EOF) && isdigit(c))
+    {
+        value = value * 10 + (c - '0');
+        has_digits = true;
+        c = fgetc(file);
+    }
+    if (!has_digits)
+    {
+        throw std::runtime_error("Invalid PPM header");
+    }
+    // The single whitespace character after the header's last value is consumed here too
+    return value;
+}
+
+// Reads a binary PPM (P6) image with 8 bits per channel, alpha is set to opaque
+std::vector<Color> read_ppm(const char *filepath, int *width, int *height)
+{
+    FILE *file = fopen(filepath, "rb");
+    if (file == NULL)
+    {
+        throw std::runtime_error("Failed to open file");
+    }
+    if ((fgetc(file) != 'P') || (fgetc(file) != '6'))
+    {
+        fclose(file);
+        throw std::runtime_error("Unsupported image format, expected binary PPM");
+    }
+
+    int max_value;
+    try
+    {
+        *width = read_ppm_header_value(file);
+        *height = read_ppm_header_value(file);
+        max_value = read_ppm_header_value(file);
+    }
+    catch (...)
+    {
+        fclose(file);
+        throw;
+    }
+    if (max_value != 255)
+    {
+        fclose(file);
+        throw std::runtime_error("Unsupported PPM maximum value, expected 255");
+    }
+
+    std::vector<Color> pixels(*width * *height);
+    for (auto &pixel : pixels)
+    {
+        unsigned char rgb[3];
+        if (fread(rgb, 1, 3, file) != 3)
+        {
+            fclose(file);
+            throw std::runtime_error("Unexpected end of PPM file");
+        }
+        pixel = {255, rgb[2], rgb[1], rgb[0]};
+    }
+    fclose(file);
+    return pixels;
+}
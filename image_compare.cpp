@@ -0,0 +1,142 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <vector>
+
+#include "image.hpp"
+
+struct Options
+{
+    const char *reference_filepath = nullptr;
+    const char *image_filepath = nullptr;
+    // Largest per channel difference that still counts as the same pixel
+    int tolerance = 2;
+    // Fraction of pixels allowed to differ by more than tolerance, e.g. silhouette pixels that flip between
+    // hit and miss when ray directions change in the last bit
+    double max_bad_fraction = 0.001;
+    // Image highlighting differing pixels is written here when set
+    const char *diff_filepath = nullptr;
+};
+
+static bool parse_options(int argc, char *argv[], Options *options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        bool has_value = (i + 1) < argc;
+        if ((strcmp(argv[i], "--tolerance") == 0) && has_value)
+        {
+            options->tolerance = atoi(argv[++i]);
+        }
+        else if ((strcmp(argv[i], "--max-bad-fraction") == 0) && has_value)
+        {
+            options->max_bad_fraction = atof(argv[++i]);
+        }
+        else if ((strcmp(argv[i], "--diff") == 0) && has_value)
+        {
+            options->diff_filepath = argv[++i];
+        }
+        else if ((argv[i][0] != '-') && (options->reference_filepath == nullptr))
+        {
+            options->reference_filepath = argv[i];
+        }
+        else if ((argv[i][0] != '-') && (options->image_filepath == nullptr))
+        {
+            options->image_filepath = argv[i];
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    return (options->reference_filepath != nullptr) && (options->image_filepath != nullptr) &&
+           (options->tolerance >= 0) && (options->max_bad_fraction >= 0.0);
+}
+
+// Compares an image against a reference and prints the differences as JSON,
+// exits with 0 when they match within tolerances, 1 when they do not and 2 on errors
+int main(int argc, char *argv[])
+{
+    Options options;
+    if (!parse_options(argc, argv, &options))
+    {
+        puts("Expected arguments: [--tolerance N] [--max-bad-fraction F] [--diff diff.ppm] reference.ppm image.ppm");
+        return 2;
+    }
+
+    int width, height, reference_width, reference_height;
+    std::vector<Color> reference, image;
+    try
+    {
+        reference = read_ppm(options.reference_filepath, &reference_width, &reference_height);
+        image = read_ppm(options.image_filepath, &width, &height);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 2;
+    }
+    if ((width != reference_width) || (height != reference_height))
+    {
+        std::cerr << "Image is " << width << "x" << height << " but reference is " << reference_width << "x"
+                  << reference_height << std::endl;
+        return 2;
+    }
+
+    int max_difference = 0;
+    size_t num_bad_pixels = 0;
+    double squared_error = 0.0;
+    std::vector<Color> diff(image.size());
+    for (size_t i = 0; i < image.size(); i++)
+    {
+        int channels[3][2] = {{image[i].r, reference[i].r}, {image[i].g, reference[i].g}, {image[i].b, reference[i].b}};
+        int pixel_difference = 0;
+        for (auto &channel : channels)
+        {
+            int difference = std::abs(channel[0] - channel[1]);
+            pixel_difference = std::max(pixel_difference, difference);
+            squared_error += difference * difference;
+        }
+        max_difference = std::max(max_difference, pixel_difference);
+
+        // Differing pixels in red over a dimmed copy of the reference
+        unsigned char gray = reference[i].g / 4;
+        if (pixel_difference > options.tolerance)
+        {
+            num_bad_pixels++;
+            diff[i] = {255, 0, 0, 255};
+        }
+        else
+        {
+            diff[i] = {255, gray, gray, gray};
+        }
+    }
+
+    double bad_fraction = image.empty() ? 0.0 : num_bad_pixels / (double)image.size();
+    double mse = image.empty() ? 0.0 : squared_error / (3.0 * image.size());
+    bool is_match = bad_fraction <= options.max_bad_fraction;
+
+    if (options.diff_filepath != nullptr)
+    {
+        write_ppm(options.diff_filepath, diff.data(), width, height);
+    }
+
+    std::cout << "{\"match\": " << (is_match ? "true" : "false") << ", \"max_difference\": " << max_difference
+              << ", \"bad_pixels\": " << num_bad_pixels << ", \"bad_fraction\": " << bad_fraction
+              << ", \"psnr\": ";
+    if (mse > 0.0)
+    {
+        std::cout << 10.0 * std::log10(255.0 * 255.0 / mse);
+    }
+    else
+    {
+        std::cout << "null";
+    }
+    std::cout << "}" << std::endl;
+
+    return is_match ? 0 : 1;
+}
@@ -0,0 +1,339 @@
+#pragma once
+
+#include <cassert>
+#include <iostream>
+#include <limits>
+#include <queue>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "bvh.hpp"
+#include "dynamic_bvh.hpp"
+#include "ray_intersection.hpp"
+#include "utils.hpp"
+#include "vec4.hpp"
+
+namespace BVH
+{
+
+    DynamicAABBTree::DynamicAABBTree(float aabb_expansion) : aabb_expansion(aabb_expansion)
+    {
+    }
+
+    int DynamicAABBTree::allocate_node()
+    {
+        if (free_node == -1)
+        {
+            nodes.emplace_back();
+            return nodes.size() - 1;
+        }
+
+        int index = free_node;
+        free_node = nodes[index].parent;
+        nodes[index] = DynamicNode();
+        return index;
+    }
+
+    void DynamicAABBTree::release_node(int index)
+    {
+        nodes[index].parent = free_node;
+        nodes[index].left = nodes[index].right = nodes[index].tri = -1;
+        free_node = index;
+    }
+
+    // Branch and bound search for the node that minimizes the total surface area added to the tree
+    // when it becomes the sibling of a new leaf, see "Fast, Effective BVH Updates for Animated Scenes" (Kopta et al.)
+    // and "Fast Insertion-Based Optimization of Bounding Volume Hierarchies" (Bittner et al.)
+    int DynamicAABBTree::find_best_sibling(const AABB &aabb) const
+    {
+        float leaf_area = calc_surface_area(aabb);
+
+        int best = root;
+        float best_cost = calc_surface_area(merge_aabbs(nodes[root].aabb, aabb));
+
+        // Pairs of (area inherited from ancestors, node), smallest inherited area first
+        using Candidate = std::pair<float, int>;
+        std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> queue;
+        queue.push({0.0f, root});
+        while (!queue.empty())
+        {
+            float inherited = queue.top().first;
+            int index = queue.top().second;
+            queue.pop();
+
+            const DynamicNode &node = nodes[index];
+            float direct = calc_surface_area(merge_aabbs(node.aabb, aabb));
+            if (direct + inherited < best_cost)
+            {
+                best = index;
+                best_cost = direct + inherited;
+            }
+
+            if (node.is_leaf())
+            {
+                continue;
+            }
+
+            // Going one level deeper, this node will grow to enclose the new leaf
+            float child_inherited = inherited + direct - calc_surface_area(node.aabb);
+            if (leaf_area + child_inherited < best_cost)
+            {
+                queue.push({child_inherited, node.left});
+                queue.push({child_inherited, node.right});
+            }
+        }
+
+        return best;
+    }
+
+    void DynamicAABBTree::replace_child(int parent, int old_child, int new_child)
+    {
+        if (parent == -1)
+        {
+            root = new_child;
+        }
+        else if (nodes[parent].left == old_child)
+        {
+            nodes[parent].left = new_child;
+        }
+        else
+        {
+            assert(nodes[parent].right == old_child);
+            nodes[parent].right = new_child;
+        }
+        nodes[new_child].parent = parent;
+    }
+
+    void DynamicAABBTree::insert_leaf(int leaf)
+    {
+        if (root == -1)
+        {
+            root = leaf;
+            nodes[leaf].parent = -1;
+            return;
+        }
+
+        int sibling = find_best_sibling(nodes[leaf].aabb);
+        int old_parent = nodes[sibling].parent;
+
+        int new_parent = allocate_node();
+        replace_child(old_parent, sibling, new_parent);
+        nodes[new_parent].left = sibling;
+        nodes[new_parent].right = leaf;
+        nodes[sibling].parent = new_parent;
+        nodes[leaf].parent = new_parent;
+
+        refit_ancestors(new_parent);
+    }
+
+    void DynamicAABBTree::remove_leaf(int leaf)
+    {
+        if (leaf == root)
+        {
+            root = -1;
+            return;
+        }
+
+        int parent = nodes[leaf].parent;
+        int grand_parent = nodes[parent].parent;
+        int sibling = (nodes[parent].left == leaf) ? nodes[parent].right : nodes[parent].left;
+
+        replace_child(grand_parent, parent, sibling);
+        release_node(parent);
+
+        if (grand_parent != -1)
+        {
+            refit_ancestors(grand_parent);
+        }
+    }
+
+    // Swaps a child of index with one of its grandchildren on the other side when that shrinks the surface area
+    // of the affected child, this is the local restructuring used by Box2D's dynamic tree (Catto, GDC 2019)
+    void DynamicAABBTree::rotate(int index)
+    {
+        int b = nodes[index].left;
+        int c = nodes[index].right;
+
+        // Candidate rotations as (node moved down, grandchild moved up)
+        int best_down = -1, best_up = -1;
+        float best_diff = 0.0f;
+
+        auto consider = [&](int down, int other_child, int up, int kept)
+        {
+            // other_child would end up containing down and kept instead of up and kept
+            float diff = calc_surface_area(merge_aabbs(nodes[down].aabb, nodes[kept].aabb)) -
+                         calc_surface_area(nodes[other_child].aabb);
+            if (diff < best_diff)
+            {
+                best_diff = diff;
+                best_down = down;
+                best_up = up;
+            }
+        };
+
+        if (!nodes[c].is_leaf())
+        {
+            consider(b, c, nodes[c].left, nodes[c].right);
+            consider(b, c, nodes[c].right, nodes[c].left);
+        }
+        if (!nodes[b].is_leaf())
+        {
+            consider(c, b, nodes[b].left, nodes[b].right);
+            consider(c, b, nodes[b].right, nodes[b].left);
+        }
+
+        if (best_down == -1)
+        {
+            return;
+        }
+
+        int other_child = nodes[best_up].parent;
+        replace_child(index, best_down, best_up);
+        replace_child(other_child, best_up, best_down);
+        nodes[other_child].aabb = merge_aabbs(nodes[nodes[other_child].left].aabb, nodes[nodes[other_child].right].aabb);
+    }
+
+    void DynamicAABBTree::refit_ancestors(int index)
+    {
+        while (index != -1)
+        {
+            DynamicNode &node = nodes[index];
+            node.aabb = merge_aabbs(nodes[node.left].aabb, nodes[node.right].aabb);
+            rotate(index);
+            index = nodes[index].parent;
+        }
+    }
+
+    int DynamicAABBTree::insert(const Triangle &tri)
+    {
+        int handle;
+        if (free_tris.empty())
+        {
+            handle = tris.size();
+            tris.push_back(tri);
+            tri_leaves.push_back(-1);
+        }
+        else
+        {
+            handle = free_tris.back();
+            free_tris.pop_back();
+            tris[handle] = tri;
+        }
+
+        int leaf = allocate_node();
+        DynamicNode &node = nodes[leaf];
+        node.tri = handle;
+        node.aabb.upper = node.aabb.lower = tri.vertices[0];
+        for (auto vertex : tri.vertices)
+        {
+            node.aabb.upper = node.aabb.upper.max(vertex);
+            node.aabb.lower = node.aabb.lower.min(vertex);
+        }
+        node.aabb.upper = node.aabb.upper + Vector4(aabb_expansion);
+        node.aabb.lower = node.aabb.lower - Vector4(aabb_expansion);
+
+        tri_leaves[handle] = leaf;
+        insert_leaf(leaf);
+        return handle;
+    }
+
+    void DynamicAABBTree::remove(int handle)
+    {
+        if ((handle < 0) || (handle >= (int)tris.size()) || (tri_leaves[handle] == -1))
+        {
+            throw std::invalid_argument("Invalid triangle handle");
+        }
+
+        int leaf = tri_leaves[handle];
+        remove_leaf(leaf);
+        release_node(leaf);
+        tri_leaves[handle] = -1;
+        free_tris.push_back(handle);
+    }
+
+    const Triangle &DynamicAABBTree::get_triangle(int handle) const
+    {
+        return tris[handle];
+    }
+
+    size_t DynamicAABBTree::size() const
+    {
+        return tris.size() - free_tris.size();
+    }
+
+    void intersect_ray_dynamic_bvh(Ray &ray, const std::vector<DynamicNode> &nodes,
+                                   const std::vector<Triangle> &tris, int index)
+    {
+        const DynamicNode &node = nodes[index];
+        if (!intersect_ray_aabb(ray, node.aabb))
+        {
+            return;
+        }
+
+        BVH_COUNT(nodes_visited);
+        BVH_COUNT_PUSH();
+        if (node.is_leaf())
+        {
+            intersect_ray_triangle(ray, tris[node.tri]);
+        }
+        else
+        {
+            intersect_ray_dynamic_bvh(ray, nodes, tris, node.left);
+            intersect_ray_dynamic_bvh(ray, nodes, tris, node.right);
+        }
+        BVH_COUNT_POP();
+    }
+
+    bool DynamicAABBTree::does_intersect_ray(Vector4 origin, Vector4 direction, float *t_out) const
+    {
+        Ray ray(origin, direction);
+        BVH_COUNT(num_rays);
+        if (root != -1)
+        {
+            intersect_ray_dynamic_bvh(ray, nodes, tris, root);
+        }
+        *t_out = ray.get_t();
+        return ray.get_t() < std::numeric_limits<float>::max();
+    }
+
+    float DynamicAABBTree::calc_sah_cost() const
+    {
+        if (root == -1)
+        {
+            return 0.0f;
+        }
+
+        float root_area = calc_surface_area(nodes[root].aabb);
+        if (root_area <= 0.0f)
+        {
+            return 0.0f;
+        }
+
+        // Every live node except free ones contributes its area once,
+        // leaves hold a single triangle so the leaf term has the same weight
+        float sum = 0.0f;
+        std::vector<int> stack = {root};
+        while (!stack.empty())
+        {
+            int index = stack.back();
+            stack.pop_back();
+            sum += calc_surface_area(nodes[index].aabb);
+            if (!nodes[index].is_leaf())
+            {
+                stack.push_back(nodes[index].left);
+                stack.push_back(nodes[index].right);
+            }
+        }
+        return sum / root_area;
+    }
+
+    void DynamicAABBTree::print_stats() const
+    {
+        std::cout << "Num. dynamic BVH triangles = " << size() << std::endl;
+        std::cout << "Num. dynamic BVH nodes = " << nodes.size() << " (" << (nodes.size() - (size() ? 2 * size() - 1 : 0))
+                  << " free)" << std::endl;
+        std::cout << "Dynamic BVH SAH cost = " << calc_sah_cost() << std::endl;
+    }
+
+}
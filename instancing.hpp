@@ -0,0 +1,164 @@
+#pragma once
+
+#include <algorithm>
+#include <iostream>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
+#include <vector>
+
+#include "bvh.hpp"
+#include "ray_intersection.hpp"
+#include "top_level_bvh.hpp"
+#include "utils.hpp"
+#include "vec4.hpp"
+
+namespace BVH
+{
+
+    int TopLevelAABBTree::add_instance(const AABBTree &tree, const Transform &transform)
+    {
+        instance_trees.push_back(&tree);
+        transforms.push_back(transform);
+        inverse_transforms.push_back(transform.inverse());
+        return instance_trees.size() - 1;
+    }
+
+    void TopLevelAABBTree::set_instance_transform(int instance, const Transform &transform)
+    {
+        if ((instance < 0) || (instance >= (int)instance_trees.size()))
+        {
+            throw std::invalid_argument("Invalid instance index");
+        }
+        transforms[instance] = transform;
+        inverse_transforms[instance] = transform.inverse();
+    }
+
+    void TopLevelAABBTree::build()
+    {
+        int num_instances = instance_trees.size();
+        instance_aabbs.resize(num_instances);
+        for (int i = 0; i < num_instances; i++)
+        {
+            instance_aabbs[i] = transforms[i].transform_aabb(instance_trees[i]->get_aabb());
+        }
+
+        instance_order.resize(num_instances);
+        std::iota(instance_order.begin(), instance_order.end(), 0);
+
+        nodes.clear();
+        if (num_instances > 0)
+        {
+            nodes.reserve(2 * num_instances);
+            build_node(0, num_instances);
+        }
+    }
+
+    // Median split along the axis of largest centroid extent,
+    // instances are few compared to triangles so build speed matters more than SAH quality here
+    int TopLevelAABBTree::build_node(int first, int count)
+    {
+        int index = nodes.size();
+        nodes.emplace_back();
+
+        AABB aabb = instance_aabbs[instance_order[first]];
+        Vector4 centroid_upper = (aabb.upper + aabb.lower) * 0.5f;
+        Vector4 centroid_lower = centroid_upper;
+        for (int i = first + 1; i < first + count; i++)
+        {
+            const AABB &instance_aabb = instance_aabbs[instance_order[i]];
+            aabb = merge_aabbs(aabb, instance_aabb);
+            Vector4 centroid = (instance_aabb.upper + instance_aabb.lower) * 0.5f;
+            centroid_upper = centroid_upper.max(centroid);
+            centroid_lower = centroid_lower.min(centroid);
+        }
+        nodes[index].aabb = aabb;
+
+        Vector4 extent = centroid_upper - centroid_lower;
+        int split_axis = 0;
+        if (extent[1] > extent[split_axis])
+        {
+            split_axis = 1;
+        }
+        if (extent[2] > extent[split_axis])
+        {
+            split_axis = 2;
+        }
+
+        if ((count == 1) || (extent[split_axis] <= 0.0f))
+        {
+            nodes[index].first = first;
+            nodes[index].count = count;
+            return index;
+        }
+
+        auto begin = instance_order.begin() + first;
+        auto middle = begin + count / 2;
+        std::nth_element(begin, middle, begin + count, [this, split_axis](int a, int b)
+                         { return (instance_aabbs[a].upper[split_axis] + instance_aabbs[a].lower[split_axis]) <
+                                  (instance_aabbs[b].upper[split_axis] + instance_aabbs[b].lower[split_axis]); });
+
+        int left = build_node(first, count / 2);
+        int right = build_node(first + count / 2, count - count / 2);
+        nodes[index].left = left;
+        nodes[index].right = right;
+        return index;
+    }
+
+    bool TopLevelAABBTree::does_intersect_ray(Vector4 origin, Vector4 direction, float *t_out) const
+    {
+        // Counted once here, instance trees visited along the way do not count it again
+        BVH_COUNT(num_rays);
+        float t_min = std::numeric_limits<float>::max();
+        if (nodes.empty())
+        {
+            *t_out = t_min;
+            return false;
+        }
+
+        Ray ray(origin, direction);
+        // Median splits keep the depth logarithmic in the number of instances
+        int stack[64];
+        int stack_size = 0;
+        stack[stack_size++] = 0;
+        while (stack_size > 0)
+        {
+            const TopLevelNode &node = nodes[stack[--stack_size]];
+            if (!intersect_ray_aabb(ray, node.aabb))
+            {
+                continue;
+            }
+
+            BVH_COUNT(nodes_visited);
+            if (!node.is_leaf())
+            {
+                stack[stack_size++] = node.left;
+                stack[stack_size++] = node.right;
+                continue;
+            }
+
+            for (int i = node.first; i < node.first + node.count; i++)
+            {
+                int instance = instance_order[i];
+                const Transform &inverse = inverse_transforms[instance];
+                // Direction is deliberately not renormalized, so t found in instance space is also t in world space
+                float t;
+                if (instance_trees[instance]->does_intersect_ray_uncounted(inverse.transform_point(origin),
+                                                                           inverse.transform_vector(direction), &t))
+                {
+                    t_min = std::min(t_min, t);
+                }
+            }
+        }
+
+        *t_out = t_min;
+        return t_min < std::numeric_limits<float>::max();
+    }
+
+    void TopLevelAABBTree::print_stats() const
+    {
+        std::cout << "Num. instances = " << instance_trees.size() << std::endl;
+        std::cout << "Num. top level BVH nodes = " << nodes.size() << std::endl;
+    }
+
+}
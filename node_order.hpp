@@ -0,0 +1,164 @@
+#pragma once
+
+#include <algorithm>
+#include <queue>
+#include <utility>
+#include <vector>
+
+#include "bvh.hpp"
+#include "utils.hpp"
+
+namespace BVH
+{
+
+    // Moves nodes within the preallocated array so that nodes traversed one after the other are close in memory,
+    // builders hand nodes out in allocation order, which keeps siblings adjacent but scatters subtrees through
+    // the whole array. Only memory placement changes, the topology and left/right order of children stay the same
+    class NodeOrderer
+    {
+    private:
+        static constexpr int PAGE_SIZE = 4096;
+        static constexpr int NODES_PER_PAGE = PAGE_SIZE / sizeof(Node);
+
+        AABBTree &tree;
+
+        std::vector<Node *> calc_depth_first_order() const;
+        std::vector<Node *> calc_subtree_clustered_order() const;
+        void apply_order(const std::vector<Node *> &order);
+
+    public:
+        explicit NodeOrderer(AABBTree &tree);
+
+        void reorder(NodeOrder order);
+    };
+
+    NodeOrderer::NodeOrderer(AABBTree &tree) : tree(tree)
+    {
+    }
+
+    // Each inner node is directly followed by its larger child, which rays are more likely to hit
+    std::vector<Node *> NodeOrderer::calc_depth_first_order() const
+    {
+        std::vector<Node *> order;
+        std::vector<Node *> stack = {tree.root};
+        while (!stack.empty())
+        {
+            Node *node = stack.back();
+            stack.pop_back();
+            order.push_back(node);
+            if (node->is_leaf())
+            {
+                continue;
+            }
+
+            bool is_left_larger = calc_surface_area(node->left->aabb) >= calc_surface_area(node->right->aabb);
+            stack.push_back(is_left_larger ? node->right : node->left);
+            stack.push_back(is_left_larger ? node->left : node->right);
+        }
+        return order;
+    }
+
+    // Cuts the tree into clusters that fill one page each, grown from the top largest surface area first,
+    // so that a ray descending the tree touches few pages. A node is one 64 byte cache line, so within a page
+    // siblings are placed next to each other, a ray that visits both reads two consecutive lines.
+    // Subtrees below a full cluster are laid out depth first, each starting where the previous one ended
+    std::vector<Node *> NodeOrderer::calc_subtree_clustered_order() const
+    {
+        std::vector<Node *> order = {tree.root};
+        // Placed inner nodes whose children are not, each one starts a new cluster
+        std::vector<Node *> cluster_parents;
+        if (!tree.root->is_leaf())
+        {
+            cluster_parents.push_back(tree.root);
+        }
+
+        using Candidate = std::pair<float, Node *>;
+        std::vector<Candidate> leftovers;
+        while (!cluster_parents.empty())
+        {
+            Node *cluster_parent = cluster_parents.back();
+            cluster_parents.pop_back();
+
+            // Fill the rest of the current page, a cluster needs room for at least one pair of siblings
+            int capacity = NODES_PER_PAGE - static_cast<int>(order.size() % NODES_PER_PAGE);
+            if (capacity < 2)
+            {
+                capacity += NODES_PER_PAGE;
+            }
+
+            std::priority_queue<Candidate> queue;
+            queue.push({calc_surface_area(cluster_parent->aabb), cluster_parent});
+            int cluster_size = 0;
+            while (!queue.empty() && (cluster_size + 2 <= capacity))
+            {
+                Node *node = queue.top().second;
+                queue.pop();
+                for (Node *child : {node->left, node->right})
+                {
+                    order.push_back(child);
+                    if (!child->is_leaf())
+                    {
+                        queue.push({calc_surface_area(child->aabb), child});
+                    }
+                }
+                cluster_size += 2;
+            }
+
+            // Largest remaining subtree is laid out next, right after this cluster
+            leftovers.clear();
+            while (!queue.empty())
+            {
+                leftovers.push_back(queue.top());
+                queue.pop();
+            }
+            for (auto it = leftovers.rbegin(); it != leftovers.rend(); ++it)
+            {
+                cluster_parents.push_back(it->second);
+            }
+        }
+        return order;
+    }
+
+    void NodeOrderer::apply_order(const std::vector<Node *> &order)
+    {
+        Node *nodes = tree.preallocated_nodes;
+        std::vector<int> new_indices(tree.num_used_nodes, -1);
+        for (int i = 0; i < (int)order.size(); i++)
+        {
+            new_indices[order[i] - nodes] = i;
+        }
+        auto remap = [&](Node *node)
+        {
+            return (node == nullptr) ? nullptr : nodes + new_indices[node - nodes];
+        };
+
+        std::vector<Node> reordered(order.size());
+        for (int i = 0; i < (int)order.size(); i++)
+        {
+            reordered[i] = *order[i];
+            reordered[i].left = remap(order[i]->left);
+            reordered[i].right = remap(order[i]->right);
+        }
+
+        // Nodes that optimizers unlinked from the tree are dropped
+        std::copy(reordered.begin(), reordered.end(), nodes);
+        tree.root = nodes;
+        tree.num_used_nodes = static_cast<int>(order.size());
+    }
+
+    void NodeOrderer::reorder(NodeOrder order)
+    {
+        switch (order)
+        {
+        case NodeOrder::ALLOCATION:
+            break;
+        case NodeOrder::DEPTH_FIRST:
+            apply_order(calc_depth_first_order());
+            break;
+        case NodeOrder::SUBTREE_CLUSTERED:
+            apply_order(calc_subtree_clustered_order());
+            break;
+        }
+    }
+
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <algorithm>
+#include <limits>
+
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+
+#include "bvh.hpp"
+#include "ray_intersection.hpp"
+#include "traversal_counters.hpp"
+#include "vec4.hpp"
+
+namespace BVH
+{
+
+    // Packet in the layout the box test wants, plus one Ray per lane for the triangle test,
+    // which is shared with single ray queries so both give exactly the same hits
+    struct PacketTraversal
+    {
+        float origin[3][RAY_PACKET_SIZE];
+        float reciprocal_direction[3][RAY_PACKET_SIZE];
+        float t[RAY_PACKET_SIZE];
+        Ray rays[RAY_PACKET_SIZE];
+    };
+
+    // Returns a bit mask of the rays hitting the box within [0, t],
+    // unlike single ray traversal boxes beyond the closest hit found so far are culled
+    int intersect_ray_packet_aabb(const PacketTraversal &packet, const AABB &aabb)
+    {
+        BVH_COUNT(boxes_tested);
+#ifdef __AVX__
+        __m256 t_enter = _mm256_setzero_ps();
+        __m256 t_exit = _mm256_loadu_ps(packet.t);
+        for (int axis = 0; axis < 3; axis++)
+        {
+            __m256 origin = _mm256_loadu_ps(packet.origin[axis]);
+            __m256 reciprocal_direction = _mm256_loadu_ps(packet.reciprocal_direction[axis]);
+            __m256 t_lower = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(aabb.lower[axis]), origin), reciprocal_direction);
+            __m256 t_upper = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(aabb.upper[axis]), origin), reciprocal_direction);
+            t_enter = _mm256_max_ps(t_enter, _mm256_min_ps(t_lower, t_upper));
+            t_exit = _mm256_min_ps(t_exit, _mm256_max_ps(t_lower, t_upper));
+        }
+        return _mm256_movemask_ps(_mm256_cmp_ps(t_enter, t_exit, _CMP_LT_OQ));
+#else
+        int mask = 0;
+        for (int i = 0; i < RAY_PACKET_SIZE; i++)
+        {
+            float t_enter = 0.0f;
+            float t_exit = packet.t[i];
+            for (int axis = 0; axis < 3; axis++)
+            {
+                float t_lower = (aabb.lower[axis] - packet.origin[axis][i]) * packet.reciprocal_direction[axis][i];
+                float t_upper = (aabb.upper[axis] - packet.origin[axis][i]) * packet.reciprocal_direction[axis][i];
+                t_enter = std::max(t_enter, std::min(t_lower, t_upper));
+                t_exit = std::min(t_exit, std::max(t_lower, t_upper));
+            }
+            mask |= (t_enter < t_exit) << i;
+        }
+        return mask;
+#endif
+    }
+
+    // mask holds the rays still worth tracing below node, the whole packet goes down a subtree
+    // as long as any of its rays hits the subtree's box
+    void intersect_ray_packet_bvh(PacketTraversal &packet, const Node *node, int mask)
+    {
+        mask &= intersect_ray_packet_aabb(packet, node->aabb);
+        if (mask == 0)
+        {
+            return;
+        }
+
+        BVH_COUNT(nodes_visited);
+        BVH_COUNT_PUSH();
+        if (node->is_leaf())
+        {
+            for (int i = 0; i < RAY_PACKET_SIZE; i++)
+            {
+                if ((mask & (1 << i)) == 0)
+                {
+                    continue;
+                }
+                for (auto it = node->begin; it != node->end; ++it)
+                {
+                    intersect_ray_triangle(packet.rays[i], *it);
+                }
+                packet.t[i] = packet.rays[i].get_t();
+            }
+        }
+        else
+        {
+            intersect_ray_packet_bvh(packet, node->left, mask);
+            intersect_ray_packet_bvh(packet, node->right, mask);
+        }
+        BVH_COUNT_POP();
+    }
+
+    void AABBTree::intersect_ray_packet(RayPacket *packet) const
+    {
+        BVH_COUNT_ADD(num_rays, RAY_PACKET_SIZE);
+        PacketTraversal traversal;
+        for (int i = 0; i < RAY_PACKET_SIZE; i++)
+        {
+            Vector4 origin(packet->origin_x[i], packet->origin_y[i], packet->origin_z[i]);
+            Vector4 direction(packet->direction_x[i], packet->direction_y[i], packet->direction_z[i]);
+            traversal.rays[i] = Ray(origin, direction);
+            for (int axis = 0; axis < 3; axis++)
+            {
+                traversal.origin[axis][i] = origin[axis];
+                traversal.reciprocal_direction[axis][i] = traversal.rays[i].get_reciprocal_direction()[axis];
+            }
+            traversal.t[i] = std::numeric_limits<float>::max();
+        }
+
+        intersect_ray_packet_bvh(traversal, root, (1 << RAY_PACKET_SIZE) - 1);
+
+        for (int i = 0; i < RAY_PACKET_SIZE; i++)
+        {
+            packet->t[i] = traversal.t[i];
+            const Triangle *tri = traversal.rays[i].get_hit_triangle();
+            if (tri != nullptr)
+            {
+                Vector4 normal = calc_facing_normal(*tri, traversal.rays[i].get_direction());
+                packet->normal_x[i] = normal.x;
+                packet->normal_y[i] = normal.y;
+                packet->normal_z[i] = normal.z;
+            }
+        }
+    }
+
+}
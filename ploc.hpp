@@ -0,0 +1,252 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "bvh.hpp"
+#include "utils.hpp"
+#include "vec4.hpp"
+
+namespace BVH
+{
+
+    // Interleaves the lower 21 bits of x, y and z into a 63 bit code
+    uint64_t calc_morton3(uint32_t x, uint32_t y, uint32_t z)
+    {
+        auto expand_bits = [](uint64_t v)
+        {
+            v &= 0x1FFFFFu;
+            v = (v | (v << 32)) & 0x1F00000000FFFFull;
+            v = (v | (v << 16)) & 0x1F0000FF0000FFull;
+            v = (v | (v << 8)) & 0x100F00F00F00F00Full;
+            v = (v | (v << 4)) & 0x10C30C30C30C30C3ull;
+            v = (v | (v << 2)) & 0x1249249249249249ull;
+            return v;
+        };
+        return (expand_bits(x) << 2) | (expand_bits(y) << 1) | expand_bits(z);
+    }
+
+    // Parallel Locally-Ordered Clustering builder, see "Parallel Locally-Ordered Clustering for Bounding Volume
+    // Hierarchy Construction" (Meister and Bittner 2018). Every triangle starts as its own cluster, in Morton order
+    // of its centroid, and each iteration merges clusters that are each other's nearest neighbour, by surface area
+    // of the merged box, within a small window of the cluster order
+    class PlocBuilder
+    {
+    private:
+        // Clusters searched for a nearest neighbour on either side of each cluster
+        static constexpr int SEARCH_RADIUS = 16;
+        static constexpr int MIN_PARALLEL_CLUSTERS = 4096;
+        // Largest leaf that collapsing subtrees may create, same as the spatial split builder's
+        static constexpr int MAX_LEAF_SIZE = 4;
+        static constexpr uint32_t MORTON_MAX = (1u << 21) - 1;
+
+        AABBTree &tree;
+
+        std::vector<Node *> make_leaves();
+        void find_nearest_neighbours(const std::vector<Node *> &clusters, std::vector<int> *nearest) const;
+        void collapse_leaves();
+        void limit_depth();
+
+    public:
+        explicit PlocBuilder(AABBTree &tree);
+
+        void build();
+    };
+
+    PlocBuilder::PlocBuilder(AABBTree &tree) : tree(tree)
+    {
+    }
+
+    // One leaf per triangle, triangles are sorted by the Morton code of their centroid within the centroid bounds
+    std::vector<Node *> PlocBuilder::make_leaves()
+    {
+        int num_tris = tree.tris.size();
+        Vector4 centroid_upper(-std::numeric_limits<float>::max());
+        Vector4 centroid_lower(std::numeric_limits<float>::max());
+        for (const Triangle &tri : tree.tris)
+        {
+            centroid_upper = centroid_upper.max(tri.calc_centroid());
+            centroid_lower = centroid_lower.min(tri.calc_centroid());
+        }
+        Vector4 extent = centroid_upper - centroid_lower;
+        Vector4 scale;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            scale[axis] = (extent[axis] > 0.0f) ? MORTON_MAX / extent[axis] : 0.0f;
+        }
+
+        // Triangle index as second key keeps the order deterministic among equal codes
+        std::vector<std::pair<uint64_t, uint32_t>> keys(num_tris);
+#pragma omp parallel for if (num_tris >= MIN_PARALLEL_CLUSTERS)
+        for (int i = 0; i < num_tris; i++)
+        {
+            Vector4 p = (tree.tris[i].calc_centroid() - centroid_lower) * scale;
+            // Rounding can put the centroid on the upper bound a hair past MORTON_MAX
+            auto quantize = [](float v)
+            {
+                uint32_t q = static_cast<uint32_t>(v);
+                return (q < MORTON_MAX) ? q : MORTON_MAX;
+            };
+            keys[i] = {calc_morton3(quantize(p.x), quantize(p.y), quantize(p.z)), static_cast<uint32_t>(i)};
+        }
+        std::sort(keys.begin(), keys.end());
+
+        std::vector<Triangle> tris = tree.tris;
+        std::vector<uint32_t> tri_indices = tree.tri_indices;
+        std::vector<Node *> clusters(num_tris);
+        for (int i = 0; i < num_tris; i++)
+        {
+            uint32_t tri_index = keys[i].second;
+            tree.tris[i] = tris[tri_index];
+            tree.tri_indices[i] = tri_indices[tri_index];
+            Node *leaf = tree.new_node(tree.tris.begin() + i, tree.tris.begin() + i + 1);
+            const Triangle &tri = tree.tris[i];
+            leaf->aabb.upper = leaf->aabb.lower = tri.vertices[0];
+            for (auto vertex : tri.vertices)
+            {
+                leaf->aabb.upper = leaf->aabb.upper.max(vertex);
+                leaf->aabb.lower = leaf->aabb.lower.min(vertex);
+            }
+            leaf->aabb.upper = leaf->aabb.upper + Vector4(tree.aabb_expansion);
+            leaf->aabb.lower = leaf->aabb.lower - Vector4(tree.aabb_expansion);
+            clusters[i] = leaf;
+        }
+        return clusters;
+    }
+
+    // Pairs are ranked by merged area, ties by distance in the cluster order, then pairs starting at an even index
+    // first, then by lower index. Every pair has a distinct rank, so the globally best pair is always mutual
+    // neighbours and every iteration merges at least one pair, and runs of clusters with equal bounds,
+    // e.g. coincident triangles, merge as adjacent pairs (0, 1), (2, 3), ... halving each iteration
+    void PlocBuilder::find_nearest_neighbours(const std::vector<Node *> &clusters, std::vector<int> *nearest) const
+    {
+        int num_clusters = clusters.size();
+#pragma omp parallel for if (num_clusters >= MIN_PARALLEL_CLUSTERS)
+        for (int i = 0; i < num_clusters; i++)
+        {
+            int best = -1;
+            float best_area = std::numeric_limits<float>::max();
+            int first = std::max(i - SEARCH_RADIUS, 0);
+            int last = std::min(i + SEARCH_RADIUS, num_clusters - 1);
+            auto rank = [i](int j)
+            {
+                int lower = std::min(i, j);
+                return std::make_tuple(std::abs(j - i), lower & 1, lower);
+            };
+            for (int j = first; j <= last; j++)
+            {
+                if (j == i)
+                {
+                    continue;
+                }
+                float area = calc_surface_area(merge_aabbs(clusters[i]->aabb, clusters[j]->aabb));
+                if ((area < best_area) || ((area == best_area) && (rank(j) < rank(best))))
+                {
+                    best = j;
+                    best_area = area;
+                }
+            }
+            (*nearest)[i] = best;
+        }
+    }
+
+    // Turns subtrees into single leaves wherever that lowers their SAH cost, with the same unit costs as
+    // calc_sah_cost(). Clustering always merges down to one triangle per leaf, even where testing a few triangles
+    // is cheaper than the nodes above them. Merged clusters are allocated after both of their children,
+    // so going through the nodes in allocation order visits every subtree before its root
+    void PlocBuilder::collapse_leaves()
+    {
+        Node *nodes = tree.preallocated_nodes;
+        std::vector<float> costs(tree.num_used_nodes);
+        for (int i = 0; i < tree.num_used_nodes; i++)
+        {
+            Node *node = nodes + i;
+            long count = std::distance(node->begin, node->end);
+            float leaf_cost = calc_surface_area(node->aabb) * count;
+            if (node->is_leaf())
+            {
+                costs[i] = leaf_cost;
+                continue;
+            }
+
+            float cost = calc_surface_area(node->aabb) + costs[node->left - nodes] + costs[node->right - nodes];
+            if ((count <= MAX_LEAF_SIZE) && (leaf_cost <= cost))
+            {
+                node->left = nullptr;
+                node->right = nullptr;
+                cost = leaf_cost;
+            }
+            costs[i] = cost;
+        }
+    }
+
+    // Clustering has no notion of depth, so nodes below options.max_depth become leaves afterwards, after
+    // relayout_tris() every node's range already covers all triangles of its subtree
+    void PlocBuilder::limit_depth()
+    {
+        std::vector<std::pair<Node *, int>> stack = {{tree.root, 0}};
+        while (!stack.empty())
+        {
+            Node *node = stack.back().first;
+            int depth = stack.back().second;
+            stack.pop_back();
+            if (node->is_leaf())
+            {
+                continue;
+            }
+            if (depth >= tree.options.max_depth)
+            {
+                node->left = nullptr;
+                node->right = nullptr;
+                continue;
+            }
+            stack.push_back({node->left, depth + 1});
+            stack.push_back({node->right, depth + 1});
+        }
+    }
+
+    void PlocBuilder::build()
+    {
+        assert(!tree.tris.empty());
+        std::vector<Node *> clusters = make_leaves();
+        std::vector<int> nearest(clusters.size());
+        std::vector<Node *> merged;
+        while (clusters.size() > 1)
+        {
+            find_nearest_neighbours(clusters, &nearest);
+
+            // Merged clusters take the place of the first of the pair, keeping the Morton order of the rest
+            merged.clear();
+            for (int i = 0; i < (int)clusters.size(); i++)
+            {
+                int j = nearest[i];
+                if (nearest[j] != i)
+                {
+                    merged.push_back(clusters[i]);
+                }
+                else if (i < j)
+                {
+                    Node *node = tree.new_node(tree.tris.end(), tree.tris.end());
+                    node->left = clusters[i];
+                    node->right = clusters[j];
+                    node->aabb = merge_aabbs(clusters[i]->aabb, clusters[j]->aabb);
+                    merged.push_back(node);
+                }
+            }
+            assert(merged.size() < clusters.size());
+            clusters.swap(merged);
+        }
+
+        tree.root = clusters[0];
+        tree.relayout_tris();
+        collapse_leaves();
+        limit_depth();
+    }
+
+}
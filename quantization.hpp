@@ -0,0 +1,218 @@
+#pragma once
+
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+#include "bvh.hpp"
+#include "quantized_bvh.hpp"
+#include "ray_intersection.hpp"
+#include "vec4.hpp"
+
+namespace BVH
+{
+
+    // Size of one quantization step along each axis of a node's bounding box
+    template <typename T>
+    Vector4 calc_quantization_scale(Vector4 lower, Vector4 upper)
+    {
+        constexpr float inv_max = 1.0f / std::numeric_limits<T>::max();
+        // Slightly inflate the step so that decoding the largest quantized value
+        // still reaches the upper bound in spite of floating point rounding
+        return (upper - lower) * (inv_max * (1.0f + 1.0f / 1024.0f));
+    }
+
+    template <typename T>
+    Vector4 dequantize(const T q[3], Vector4 lower, Vector4 scale)
+    {
+        return lower + Vector4(q[0], q[1], q[2]) * scale;
+    }
+
+    template <typename T>
+    void quantize_aabb(const AABB &aabb, Vector4 lower, Vector4 scale, T lower_q[3], T upper_q[3])
+    {
+        constexpr float q_max = std::numeric_limits<T>::max();
+        for (int axis = 0; axis < 3; axis++)
+        {
+            float lo = 0.0f;
+            float hi = 0.0f;
+            if (scale[axis] > 0.0f)
+            {
+                lo = std::floor((aabb.lower[axis] - lower[axis]) / scale[axis]);
+                hi = std::ceil((aabb.upper[axis] - lower[axis]) / scale[axis]);
+            }
+            lower_q[axis] = static_cast<T>(std::fmin(std::fmax(lo, 0.0f), q_max));
+            upper_q[axis] = static_cast<T>(std::fmin(std::fmax(hi, 0.0f), q_max));
+        }
+
+        // Rounding of the division above can be off by one step,
+        // widen until the decoded box encloses the original one
+        for (int axis = 0; axis < 3; axis++)
+        {
+            while (lower_q[axis] > 0 && dequantize(lower_q, lower, scale)[axis] > aabb.lower[axis])
+            {
+                lower_q[axis]--;
+            }
+            while (upper_q[axis] < q_max && dequantize(upper_q, lower, scale)[axis] < aabb.upper[axis])
+            {
+                upper_q[axis]++;
+            }
+        }
+    }
+
+    // Decodes child bounds relative to the parent's box and tests them against the ray,
+    // the decoded box is returned because it becomes the reference frame of the child's own children
+    template <typename T>
+    bool intersect_ray_quantized_aabb(const Ray &ray, const T lower_q[3], const T upper_q[3],
+                                      Vector4 lower, Vector4 scale, AABB *decoded)
+    {
+        decoded->lower = dequantize(lower_q, lower, scale);
+        decoded->upper = dequantize(upper_q, lower, scale);
+        return intersect_ray_aabb(ray, *decoded);
+    }
+
+    template <typename T>
+    void intersect_ray_quantized_bvh(Ray &ray, const std::vector<QuantizedNode<T>> &nodes,
+                                     const std::vector<Triangle> &tris, uint32_t node_index,
+                                     Vector4 lower, Vector4 upper)
+    {
+        const QuantizedNode<T> &node = nodes[node_index];
+        Vector4 scale = calc_quantization_scale<T>(lower, upper);
+        BVH_COUNT(nodes_visited);
+        BVH_COUNT_PUSH();
+        for (int i = 0; i < 2; i++)
+        {
+            AABB child_aabb;
+            if (!intersect_ray_quantized_aabb(ray, node.child_lower[i], node.child_upper[i], lower, scale, &child_aabb))
+            {
+                continue;
+            }
+
+            if (node.is_child_leaf(i))
+            {
+                BVH_COUNT(nodes_visited);
+                for (uint32_t j = node.index[i]; j < node.index[i] + node.count[i]; j++)
+                {
+                    intersect_ray_triangle(ray, tris[j]);
+                }
+            }
+            else
+            {
+                intersect_ray_quantized_bvh(ray, nodes, tris, node.index[i], child_aabb.lower, child_aabb.upper);
+            }
+        }
+        BVH_COUNT_POP();
+    }
+
+    template <typename T>
+    QuantizedAABBTree<T>::QuantizedAABBTree(const AABBTree &tree) : tree(tree)
+    {
+        const Node *root = tree.root;
+        root_aabb = root->aabb;
+        if (root->is_leaf())
+        {
+            root_index = 0;
+            root_count = tree.tris.size();
+        }
+        else
+        {
+            nodes.reserve(tree.num_used_nodes / 2);
+            root_index = add_node(root, root_aabb.lower, root_aabb.upper);
+            root_count = 0;
+        }
+    }
+
+    // lower and upper are the node's bounds as seen by traversal, i.e. already decoded,
+    // so that quantization and dequantization use exactly the same reference frame
+    template <typename T>
+    uint32_t QuantizedAABBTree<T>::add_node(const Node *node, Vector4 lower, Vector4 upper)
+    {
+        assert(!node->is_leaf());
+
+        uint32_t index = nodes.size();
+        nodes.emplace_back();
+
+        Vector4 scale = calc_quantization_scale<T>(lower, upper);
+        const Node *children[2] = {node->left, node->right};
+        for (int i = 0; i < 2; i++)
+        {
+            const Node *child = children[i];
+            T lower_q[3], upper_q[3];
+            quantize_aabb(child->aabb, lower, scale, lower_q, upper_q);
+
+            uint32_t child_index, child_count;
+            if (child->is_leaf())
+            {
+                child_index = std::distance(tree.tris.begin(), std::vector<Triangle>::const_iterator(child->begin));
+                child_count = std::distance(child->begin, child->end);
+            }
+            else
+            {
+                child_index = add_node(child, dequantize(lower_q, lower, scale), dequantize(upper_q, lower, scale));
+                child_count = 0;
+            }
+
+            // Recursion above may reallocate nodes, so only take a reference now
+            QuantizedNode<T> &qnode = nodes[index];
+            for (int axis = 0; axis < 3; axis++)
+            {
+                qnode.child_lower[i][axis] = lower_q[axis];
+                qnode.child_upper[i][axis] = upper_q[axis];
+            }
+            qnode.index[i] = child_index;
+            qnode.count[i] = child_count;
+        }
+
+        return index;
+    }
+
+    template <typename T>
+    bool QuantizedAABBTree<T>::does_intersect_ray(Vector4 origin, Vector4 direction, float *t_out) const
+    {
+        Ray ray(origin, direction);
+        BVH_COUNT(num_rays);
+        if (intersect_ray_aabb(ray, root_aabb))
+        {
+            if (root_count > 0)
+            {
+                BVH_COUNT(nodes_visited);
+                for (uint32_t i = root_index; i < root_index + root_count; i++)
+                {
+                    intersect_ray_triangle(ray, tree.tris[i]);
+                }
+            }
+            else
+            {
+                intersect_ray_quantized_bvh(ray, nodes, tree.tris, root_index, root_aabb.lower, root_aabb.upper);
+            }
+        }
+        *t_out = ray.get_t();
+        return ray.get_t() < std::numeric_limits<float>::max();
+    }
+
+    template <typename T>
+    size_t QuantizedAABBTree<T>::calc_nodes_memory_usage() const
+    {
+        return sizeof(root_aabb) + nodes.size() * sizeof(QuantizedNode<T>);
+    }
+
+    template <typename T>
+    void QuantizedAABBTree<T>::print_stats() const
+    {
+        // Same measure as TreeStats::nodes_memory of the source tree
+        size_t source_nodes_memory = tree.num_preallocated_nodes * sizeof(Node);
+        std::cout << "Num. quantized BVH triangles = " << tree.tris.size() << std::endl;
+        std::cout << "Num. quantized BVH internal nodes = " << nodes.size() << std::endl;
+        std::cout << "Quantized BVH nodes memory = " << calc_nodes_memory_usage() << " bytes ("
+                  << sizeof(T) * 8 << "-bit bounds)" << std::endl;
+        std::cout << "Source BVH nodes memory = " << source_nodes_memory << " bytes, quantized is "
+                  << 100.0 * calc_nodes_memory_usage() / source_nodes_memory << "%" << std::endl;
+    }
+
+    template class QuantizedAABBTree<uint8_t>;
+    template class QuantizedAABBTree<uint16_t>;
+
+}
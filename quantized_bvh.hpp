@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "bvh.hpp"
+#include "non_copyable.hpp"
+#include "vec4.hpp"
+
+namespace BVH
+{
+
+    // Internal node of a QuantizedAABBTree, children bounds are stored as integers
+    // relative to the (decoded) bounds of the node itself
+    template <typename T>
+    struct QuantizedNode
+    {
+        T child_lower[2][3];
+        T child_upper[2][3];
+
+        // When count is zero the child is an internal node and index is its position in the nodes array,
+        // otherwise the child is a leaf that references triangles [index, index + count)
+        uint32_t index[2];
+        uint32_t count[2];
+
+        bool is_child_leaf(int i) const
+        {
+            return count[i] != 0;
+        }
+    };
+
+    // Compressed copy of an AABBTree, child bounds are quantized to 8 or 16 bits per axis
+    // and rounded conservatively (lower bounds down, upper bounds up),
+    // so queries return the same results as the source tree while using much less memory for nodes.
+    // Leaves index into the source tree's triangles, the source tree is referenced, not copied, and must outlive this
+    template <typename T>
+    class QuantizedAABBTree : public NonCopyable
+    {
+    private:
+        const AABBTree &tree;
+        std::vector<QuantizedNode<T>> nodes;
+        AABB root_aabb;
+        uint32_t root_index = 0, root_count = 0;
+
+        uint32_t add_node(const Node *node, Vector4 lower, Vector4 upper);
+
+    public:
+        explicit QuantizedAABBTree(const AABBTree &tree);
+
+        bool does_intersect_ray(Vector4 origin, Vector4 direction, float *t_out) const;
+
+        size_t calc_nodes_memory_usage() const;
+
+        void print_stats() const;
+    };
+
+    using QuantizedAABBTree8 = QuantizedAABBTree<uint8_t>;
+    using QuantizedAABBTree16 = QuantizedAABBTree<uint16_t>;
+
+}
@@ -3,6 +3,7 @@
 #include <limits>
 
 #include "bvh.hpp"
+#include "traversal_counters.hpp"
 #include "utils.hpp"
 #include "vec4.hpp"
 
@@ -14,8 +15,12 @@ namespace BVH
     private:
         Vector4 m_origin, m_direction, m_reciprocal_direction;
         float m_t;
+        // Triangle at distance m_t, null while nothing was hit
+        const Triangle *m_hit_tri = nullptr;
 
     public:
+        Ray() = default;
+
         Ray(Vector4 origin, Vector4 direction)
         {
             m_origin = origin;
@@ -48,10 +53,23 @@ namespace BVH
         {
             this->m_t = t;
         }
+
+        const Triangle *get_hit_triangle() const
+        {
+            return m_hit_tri;
+        }
+
+        void set_hit(float t, const Triangle *tri)
+        {
+            m_t = t;
+            m_hit_tri = tri;
+        }
     };
 
     void intersect_ray_triangle(Ray &ray, const Triangle &tri)
     {
+        BVH_COUNT(triangles_tested);
+
         // TODO: reduce code duplication,
         //       same code is repeated in segment/triangle intersection
         constexpr float COPLANAR_THRESHOLD = 0.00001;
@@ -80,12 +98,23 @@ namespace BVH
             is_point_above_plane(p, p2_n, tri.vertices[1]) &&
             is_point_above_plane(p, p3_n, tri.vertices[2]))
         {
-            ray.set_t(std::min(ray.get_t(), t));
+            if (t < ray.get_t())
+            {
+                ray.set_hit(t, &tri);
+            }
         }
     }
 
+    // Unit normal of the triangle's plane, flipped to face against direction
+    Vector4 calc_facing_normal(const Triangle &tri, Vector4 direction)
+    {
+        Vector4 normal = (tri.vertices[1] - tri.vertices[0]).cross3(tri.vertices[2] - tri.vertices[0]).normalized3();
+        return (normal.dot3(direction) > 0) ? normal * -1 : normal;
+    }
+
     bool intersect_ray_aabb(const Ray &ray, const AABB &aabb)
     {
+        BVH_COUNT(boxes_tested);
         Vector4 t_upper = (aabb.upper - ray.get_origin()) * ray.get_reciprocal_direction();
         Vector4 t_lower = (aabb.lower - ray.get_origin()) * ray.get_reciprocal_direction();
         Vector4 t_min_v = t_upper.min(t_lower);
@@ -98,6 +127,21 @@ namespace BVH
         return t_max > t_min;
     }
 
+    // Same as intersect_ray_aabb but also rejects boxes outside the [0, t_max] range of the ray
+    bool intersect_ray_aabb(const Ray &ray, const AABB &aabb, float t_max)
+    {
+        BVH_COUNT(boxes_tested);
+        Vector4 t_upper = (aabb.upper - ray.get_origin()) * ray.get_reciprocal_direction();
+        Vector4 t_lower = (aabb.lower - ray.get_origin()) * ray.get_reciprocal_direction();
+        Vector4 t_min_v = t_upper.min(t_lower);
+        Vector4 t_max_v = t_upper.max(t_lower);
+
+        float t_enter = t_min_v.max_elem3();
+        float t_exit = t_max_v.min_elem3();
+
+        return (t_exit > t_enter) && (t_enter < t_max) && (t_exit > 0);
+    }
+
     void intersect_ray_bvh(Ray &ray, Node *node)
     {
         if (node == nullptr)
@@ -110,6 +154,8 @@ namespace BVH
             return;
         }
 
+        BVH_COUNT(nodes_visited);
+        BVH_COUNT_PUSH();
         if (node->is_leaf())
         {
             for (auto it = node->begin; it != node->end; ++it)
@@ -122,6 +168,34 @@ namespace BVH
             intersect_ray_bvh(ray, node->left);
             intersect_ray_bvh(ray, node->right);
         }
+        BVH_COUNT_POP();
+    }
+
+    // Any hit query, stops at the first triangle closer than t_max
+    bool is_ray_occluded_bvh(Ray &ray, Node *node, float t_max)
+    {
+        if (!intersect_ray_aabb(ray, node->aabb, t_max))
+        {
+            return false;
+        }
+
+        BVH_COUNT(nodes_visited);
+        BVH_COUNT_PUSH();
+        bool is_occluded = false;
+        if (node->is_leaf())
+        {
+            for (auto it = node->begin; (it != node->end) && !is_occluded; ++it)
+            {
+                intersect_ray_triangle(ray, *it);
+                is_occluded = ray.get_t() < t_max;
+            }
+        }
+        else
+        {
+            is_occluded = is_ray_occluded_bvh(ray, node->left, t_max) || is_ray_occluded_bvh(ray, node->right, t_max);
+        }
+        BVH_COUNT_POP();
+        return is_occluded;
     }
 
 }
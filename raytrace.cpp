@@ -1,14 +1,27 @@
+#include <algorithm>
 #include <chrono>
 #include <cmath>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <limits>
 #include <vector>
 
 #include <SDL.h>
 
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+
 #include "bvh.hpp"
 #include "camera.hpp"
+#include "camera_path.hpp"
+#include "frame_stats.hpp"
+#include "image.hpp"
 #include "raytrace.hpp"
+#include "render_thread.hpp"
 #include "vec4.hpp"
 
 constexpr int WINDOW_WIDTH = 640;
@@ -16,86 +29,683 @@ constexpr int WINDOW_HEIGHT = 640;
 constexpr float ROTATION_SPEED = .001;
 constexpr float MOVEMENT_SPEED = .1;
 
-Camera cam({0, -2, 0}, {0, 0, 0});
-double total_time_ns = 0.0;
-size_t num_frames = 0;
+// Recorded camera paths hold rotations relative to this camera's orientation
+static Camera make_start_camera()
+{
+    return Camera({0, -2, 0}, {0, 0, 0});
+}
+
+Camera cam = make_start_camera();
+bool print_frame_times = true;
+// Work done by the last rendered frame, all zero unless the bvh library is built with BVH_TRAVERSAL_COUNTERS
+BVH::TraversalCounters frame_counters;
+// Primary and secondary rays traced by the last rendered frame
+int frame_num_rays = 0;
 
-struct Color
+enum class RenderMode
 {
-    unsigned char a, b, g, r;
+    // Shade by hit distance
+    DEPTH,
+    // Shade by the number of nodes visited and triangles tested by each pixel's ray,
+    // needs the bvh library to be built with BVH_TRAVERSAL_COUNTERS
+    HEATMAP,
+    // Shade by the fraction of occlusion rays, spawned over the hemisphere around each hit, that escape,
+    // a much less coherent workload than primary rays alone
+    AMBIENT_OCCLUSION,
 };
 
-static void render(Color *pixels, const BVH::AABBTree &bvh, int width, int height)
+// Traversal cost mapped to the hottest heatmap color, fixed rather than per frame
+// so heatmaps of different trees or builders can be compared directly
+float heatmap_max_cost = 200.0f;
+
+static Color calc_heatmap_color(float cost)
 {
-    float fov = cam.get_fov();
-    float tan_half_fov = std::tan(fov / 2);
-    Vector4 cam_pos = cam.get_pos();
-    Vector4 up;
-    Vector4 right;
-    Vector4 forward;
-    cam.calc_vectors(&up, &right, &forward);
+    // Blue through green to red
+    float t = std::min(cost / heatmap_max_cost, 1.0f);
+    auto channel = [t](float center) {
+        return (unsigned char)(255 * std::max(0.0f, std::min(1.5f - std::fabs(4 * t - center), 1.0f)));
+    };
+    return {255, channel(1), channel(2), channel(3)};
+}
 
-    float aspect_ratio;
-    if (width > height)
+// Occlusion rays per primary hit and how far they look for occluders, in scene units
+int num_ao_samples = 8;
+float ao_distance = 0.5f;
+
+// Avalanching integer hash, used as a deterministic per pixel random number generator
+// so that ambient occlusion frames, and images dumped from them, are reproducible
+static uint32_t hash_uint32(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+// Traces cosine weighted occlusion rays over the hemisphere around normal, returns the number of rays traced
+static int calc_ao_color(const BVH::AABBTree &bvh, Vector4 hit_point, Vector4 normal, uint32_t pixel_index, Color *color)
+{
+    Vector4 helper = (std::fabs(normal.x) > 0.9f) ? Vector4(0, 1, 0) : Vector4(1, 0, 0);
+    Vector4 tangent = helper.cross3(normal).normalized3();
+    Vector4 bitangent = normal.cross3(tangent);
+    // Start slightly off the surface to avoid hitting the triangle the rays start on
+    Vector4 origin = hit_point + normal * (ao_distance * 1e-3f);
+
+    int num_unoccluded = 0;
+    for (int i = 0; i < num_ao_samples; i++)
     {
-        aspect_ratio = width / (float)height;
+        uint32_t seed = hash_uint32(pixel_index * num_ao_samples + i);
+        float u1 = (seed & 0xffff) / 65536.0f;
+        float u2 = (seed >> 16) / 65536.0f;
+        float phi = 2 * 3.14159265f * u1;
+        float radius = std::sqrt(u2);
+        Vector4 direction = tangent * (radius * std::cos(phi)) + bitangent * (radius * std::sin(phi)) + normal * std::sqrt(1 - u2);
+        num_unoccluded += !bvh.is_ray_occluded(origin, direction, ao_distance);
     }
-    else
+
+    unsigned char pixel_color = 255 * num_unoccluded / num_ao_samples;
+    *color = {255, pixel_color, pixel_color, pixel_color};
+    return num_ao_samples;
+}
+
+// Side of the square blocks of pixels distributed to threads, a power of two so Morton codes cover a tile exactly
+constexpr int TILE_SIZE = 16;
+
+// Even bits of a 2D Morton code, i.e. its x coordinate, pass code >> 1 to get y
+static uint32_t decode_morton2_x(uint32_t code)
+{
+    code &= 0x55555555;
+    code = (code | (code >> 1)) & 0x33333333;
+    code = (code | (code >> 2)) & 0x0f0f0f0f;
+    code = (code | (code >> 4)) & 0x00ff00ff;
+    code = (code | (code >> 8)) & 0x0000ffff;
+    return code;
+}
+
+// Pixel offsets of the rays of a packet, 8 consecutive Morton codes cover a block of 4x2 pixels
+constexpr int PACKET_OFFSETS_X[BVH::RAY_PACKET_SIZE] = {0, 1, 0, 1, 2, 3, 2, 3};
+constexpr int PACKET_OFFSETS_Y[BVH::RAY_PACKET_SIZE] = {0, 0, 1, 1, 0, 0, 1, 1};
+
+// Generates the primary rays of a 4x2 block of pixels in structure of arrays layout, 8 at a time with AVX.
+// Directions are linear in the pixel coordinates, so they are built from per pixel increments
+// computed once per frame, and normalized with a reciprocal square root estimate refined by one Newton step
+class PrimaryRays
+{
+private:
+    Vector4 origin;
+    // Unnormalized direction through pixel (0, 0) and its change per pixel along x and y
+    Vector4 corner, step_x, step_y;
+
+public:
+    PrimaryRays(const Camera &camera, int width, int height)
     {
-        aspect_ratio = height / (float)width;
+        float tan_half_fov = std::tan(camera.get_fov() / 2);
+        Vector4 up;
+        Vector4 right;
+        Vector4 forward;
+        camera.calc_vectors(&up, &right, &forward);
+
+        float aspect_ratio;
+        if (width > height)
+        {
+            aspect_ratio = width / (float)height;
+        }
+        else
+        {
+            aspect_ratio = height / (float)width;
+        }
+
+        origin = camera.get_pos();
+        corner = forward - right * tan_half_fov * aspect_ratio + up * tan_half_fov;
+        step_x = right * (tan_half_fov * aspect_ratio * 2 / width);
+        step_y = up * (-tan_half_fov * 2 / height);
     }
 
-    auto t1 = std::chrono::high_resolution_clock::now();
-#pragma omp parallel for default(none) firstprivate(aspect_ratio, width, height, cam_pos, forward, right, tan_half_fov, up) shared(bvh, pixels)
-    for (int i = 0; i < width * height; i++)
+    void generate_packet(int x, int y, BVH::RayPacket *packet) const
     {
-        int pixel_x = i % width;
-        int pixel_y = i / width;
-        float pixel_x_normalized = pixel_x / (float)width;
-        float pixel_y_normalized = pixel_y / (float)height;
+        float *directions[3] = {packet->direction_x, packet->direction_y, packet->direction_z};
+        float *origins[3] = {packet->origin_x, packet->origin_y, packet->origin_z};
+#ifdef __AVX__
+        __m256 pixel_x = _mm256_add_ps(_mm256_set1_ps((float)x), _mm256_setr_ps(0, 1, 0, 1, 2, 3, 2, 3));
+        __m256 pixel_y = _mm256_add_ps(_mm256_set1_ps((float)y), _mm256_setr_ps(0, 0, 1, 1, 0, 0, 1, 1));
+        __m256 direction[3];
+        __m256 length_squared = _mm256_setzero_ps();
+        for (int axis = 0; axis < 3; axis++)
+        {
+            direction[axis] = _mm256_add_ps(_mm256_set1_ps(corner[axis]),
+                                            _mm256_add_ps(_mm256_mul_ps(pixel_x, _mm256_set1_ps(step_x[axis])),
+                                                          _mm256_mul_ps(pixel_y, _mm256_set1_ps(step_y[axis]))));
+            length_squared = _mm256_add_ps(length_squared, _mm256_mul_ps(direction[axis], direction[axis]));
+        }
+        __m256 inv_length = _mm256_rsqrt_ps(length_squared);
+        // r' = r * (1.5 - 0.5 * x * r * r)
+        __m256 half_x_r_r = _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(0.5f), length_squared),
+                                          _mm256_mul_ps(inv_length, inv_length));
+        inv_length = _mm256_mul_ps(inv_length, _mm256_sub_ps(_mm256_set1_ps(1.5f), half_x_r_r));
+        for (int axis = 0; axis < 3; axis++)
+        {
+            _mm256_storeu_ps(directions[axis], _mm256_mul_ps(direction[axis], inv_length));
+            _mm256_storeu_ps(origins[axis], _mm256_set1_ps(origin[axis]));
+        }
+#else
+        for (int i = 0; i < BVH::RAY_PACKET_SIZE; i++)
+        {
+            Vector4 direction = corner + step_x * (float)(x + PACKET_OFFSETS_X[i]) + step_y * (float)(y + PACKET_OFFSETS_Y[i]);
+            direction = direction.normalized3();
+            for (int axis = 0; axis < 3; axis++)
+            {
+                directions[axis][i] = direction[axis];
+                origins[axis][i] = origin[axis];
+            }
+        }
+#endif
+    }
+};
+
+static Color calc_depth_color(float t)
+{
+    if (t == std::numeric_limits<float>::max())
+    {
+        return {255, 0, 0, 0};
+    }
+
+    // Map t from [0, inf[ to [0, 1[
+    // https://math.stackexchange.com/a/3200751/691043
+    float t_normalized = std::atan(t) / (3.14 / 2);
+    unsigned char pixel_color = (t_normalized * t_normalized) * 255;
+    return {255, pixel_color, pixel_color, pixel_color};
+}
+
+// Pixels are traced in tiles, each walked in Z-order, so that rays running back to back on a thread
+// are close on screen and keep hitting the same BVH nodes in cache
+static void render(Color *pixels, const BVH::AABBTree &bvh, const Camera &camera, int width, int height, RenderMode mode,
+                   FrameTimings *timings)
+{
+    PrimaryRays primary_rays(camera, width, height);
+
+    auto t1 = std::chrono::steady_clock::now();
+    BVH::TraversalCounters counters;
+    int num_rays = 0;
+    int num_threads = 0;
+    double raygen_ms = 0.0;
+    double trace_ms = 0.0;
+#pragma omp parallel default(none) firstprivate(width, height, mode, primary_rays) shared(bvh, pixels, counters) \
+    reduction(+ : num_rays, num_threads, raygen_ms, trace_ms)
+    {
+        BVH::reset_traversal_counters();
+        num_threads++;
+        int num_tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+        int num_tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+        // Tiles are handed out one at a time since their cost varies a lot with the geometry behind them
+#pragma omp for schedule(dynamic, 1)
+        for (int tile = 0; tile < num_tiles_x * num_tiles_y; tile++)
+        {
+            int tile_x = (tile % num_tiles_x) * TILE_SIZE;
+            int tile_y = (tile / num_tiles_x) * TILE_SIZE;
+
+            // All packets of the tile are generated before any is traced, so that the two stages can be timed apart
+            constexpr int NUM_TILE_PACKETS = TILE_SIZE * TILE_SIZE / BVH::RAY_PACKET_SIZE;
+            BVH::RayPacket packets[NUM_TILE_PACKETS];
+            auto raygen_start = std::chrono::steady_clock::now();
+            for (int p = 0; p < NUM_TILE_PACKETS; p++)
+            {
+                uint32_t code = p * BVH::RAY_PACKET_SIZE;
+                primary_rays.generate_packet(tile_x + decode_morton2_x(code), tile_y + decode_morton2_x(code >> 1), &packets[p]);
+            }
+            auto trace_start = std::chrono::steady_clock::now();
+
+            for (int p = 0; p < NUM_TILE_PACKETS; p++)
+            {
+                uint32_t code = p * BVH::RAY_PACKET_SIZE;
+                BVH::RayPacket &packet = packets[p];
+
+                float costs[BVH::RAY_PACKET_SIZE];
+                if (mode == RenderMode::HEATMAP)
+                {
+                    // Rays are traced one by one so that counters can be read per pixel
+                    for (int i = 0; i < BVH::RAY_PACKET_SIZE; i++)
+                    {
+                        Vector4 ray_origin(packet.origin_x[i], packet.origin_y[i], packet.origin_z[i]);
+                        Vector4 ray_direction(packet.direction_x[i], packet.direction_y[i], packet.direction_z[i]);
+                        BVH::TraversalCounters before = BVH::get_traversal_counters();
+                        bvh.does_intersect_ray(ray_origin, ray_direction, &packet.t[i]);
+                        BVH::TraversalCounters after = BVH::get_traversal_counters();
+                        costs[i] = (after.nodes_visited - before.nodes_visited) + (after.triangles_tested - before.triangles_tested);
+                    }
+                }
+                else
+                {
+                    bvh.intersect_ray_packet(&packet);
+                }
+
+                for (int i = 0; i < BVH::RAY_PACKET_SIZE; i++)
+                {
+                    int pixel_x = tile_x + decode_morton2_x(code + i);
+                    int pixel_y = tile_y + decode_morton2_x((code + i) >> 1);
+                    if ((pixel_x >= width) || (pixel_y >= height))
+                    {
+                        continue;
+                    }
+                    // Lanes past the image edge are traced too but do not count, so rays match pixels
+                    num_rays++;
 
-        pixel_x_normalized = 2 * pixel_x_normalized - 1;
-        pixel_x_normalized *= aspect_ratio;
-        pixel_y_normalized = 1 - 2 * pixel_y_normalized;
+                    Color color;
+                    if (mode == RenderMode::HEATMAP)
+                    {
+                        color = calc_heatmap_color(costs[i]);
+                    }
+                    else if ((mode == RenderMode::AMBIENT_OCCLUSION) && (packet.t[i] < std::numeric_limits<float>::max()))
+                    {
+                        Vector4 origin(packet.origin_x[i], packet.origin_y[i], packet.origin_z[i]);
+                        Vector4 direction(packet.direction_x[i], packet.direction_y[i], packet.direction_z[i]);
+                        Vector4 normal(packet.normal_x[i], packet.normal_y[i], packet.normal_z[i]);
+                        num_rays += calc_ao_color(bvh, origin + direction * packet.t[i], normal, pixel_x + pixel_y * width, &color);
+                    }
+                    else
+                    {
+                        color = calc_depth_color(packet.t[i]);
+                    }
+                    pixels[pixel_x + pixel_y * width] = color;
+                }
+            }
 
-        Vector4 pixel_pos = cam_pos + forward + right * tan_half_fov * pixel_x_normalized + up * tan_half_fov * pixel_y_normalized;
+            auto trace_end = std::chrono::steady_clock::now();
+            raygen_ms += std::chrono::duration<double, std::milli>(trace_start - raygen_start).count();
+            trace_ms += std::chrono::duration<double, std::milli>(trace_end - trace_start).count();
+        }
 
-        Vector4 ray_origin = cam_pos;
-        Vector4 ray_direction = (pixel_pos - cam_pos).normalized3();
+        // Counters are per thread, so they are merged once per thread instead of once per ray
+#pragma omp critical
+        counters.merge(BVH::get_traversal_counters());
+    }
+    auto t2 = std::chrono::steady_clock::now();
+    timings->raygen_ms = raygen_ms / num_threads;
+    timings->trace_ms = trace_ms / num_threads;
+    timings->present_ms = 0.0;
+    timings->total_ms = std::chrono::duration<double, std::milli>(t2 - t1).count();
+    frame_counters = counters;
+    frame_num_rays = num_rays;
+    if (print_frame_times)
+    {
+        std::cout << "Rendering took: " << timings->total_ms << " milli seconds (raygen " << timings->raygen_ms
+                  << ", trace " << timings->trace_ms << ")";
+#ifdef BVH_TRAVERSAL_COUNTERS
+        double inv_num_rays = 1.0 / std::max<uint64_t>(counters.num_rays, 1);
+        std::cout << ", nodes/ray = " << counters.nodes_visited * inv_num_rays
+                  << ", boxes/ray = " << counters.boxes_tested * inv_num_rays
+                  << ", tris/ray = " << counters.triangles_tested * inv_num_rays
+                  << ", max depth = " << counters.max_stack_depth;
+#endif
+        std::cout << std::endl;
+    }
+}
+
+struct Options
+{
+    const char *mesh_filepath = nullptr;
+    bool is_headless = false;
+    int num_frames = 100;
+    int num_warmup_frames = 3;
+    int width = WINDOW_WIDTH;
+    int height = WINDOW_HEIGHT;
+    RenderMode mode = RenderMode::DEPTH;
+    BVH::BuildMethod build_method = BVH::BuildMethod::VARIANCE;
+    int treelet_passes = 0;
+    int reinsertion_passes = 0;
+    BVH::NodeOrder node_order = BVH::NodeOrder::ALLOCATION;
+    // Interactive frames are traced at reduced resolution while the camera moves, to stay within target_frame_ms
+    bool is_adaptive = false;
+    double target_frame_ms = 33.0;
+    // Last headless frame is written here as a PPM image when set
+    const char *dump_filepath = nullptr;
+    // Camera pose of every interactive frame is written here at exit when set
+    const char *record_filepath = nullptr;
+    // Camera path, as written by record_filepath, driving both interactive and headless frames when set,
+    // in headless mode it also replaces the scripted path and sets the number of frames
+    const char *replay_filepath = nullptr;
+    // Per frame stage timings are written here as CSV, and their summary as JSON, at exit when set
+    const char *timings_csv_filepath = nullptr;
+    const char *timings_json_filepath = nullptr;
+};
 
-        float t = 0.0f;
-        if (bvh.does_intersect_ray(ray_origin, ray_direction, &t))
+static bool parse_options(int argc, char *argv[], Options *options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        bool has_value = (i + 1) < argc;
+        if (strcmp(argv[i], "--headless") == 0)
+        {
+            options->is_headless = true;
+        }
+        else if ((strcmp(argv[i], "--frames") == 0) && has_value)
+        {
+            options->num_frames = atoi(argv[++i]);
+        }
+        else if ((strcmp(argv[i], "--warmup") == 0) && has_value)
+        {
+            options->num_warmup_frames = atoi(argv[++i]);
+        }
+        else if ((strcmp(argv[i], "--width") == 0) && has_value)
+        {
+            options->width = atoi(argv[++i]);
+        }
+        else if ((strcmp(argv[i], "--height") == 0) && has_value)
+        {
+            options->height = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--heatmap") == 0)
+        {
+            options->mode = RenderMode::HEATMAP;
+        }
+        else if (strcmp(argv[i], "--ao") == 0)
+        {
+            options->mode = RenderMode::AMBIENT_OCCLUSION;
+        }
+        else if ((strcmp(argv[i], "--ao-samples") == 0) && has_value)
+        {
+            num_ao_samples = atoi(argv[++i]);
+        }
+        else if ((strcmp(argv[i], "--ao-distance") == 0) && has_value)
+        {
+            ao_distance = atof(argv[++i]);
+        }
+        else if ((strcmp(argv[i], "--heatmap-max") == 0) && has_value)
+        {
+            heatmap_max_cost = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--adaptive") == 0)
+        {
+            options->is_adaptive = true;
+        }
+        else if ((strcmp(argv[i], "--target-ms") == 0) && has_value)
+        {
+            options->target_frame_ms = atof(argv[++i]);
+        }
+        else if ((strcmp(argv[i], "--record") == 0) && has_value)
+        {
+            options->record_filepath = argv[++i];
+        }
+        else if ((strcmp(argv[i], "--replay") == 0) && has_value)
+        {
+            options->replay_filepath = argv[++i];
+        }
+        else if ((strcmp(argv[i], "--timings-csv") == 0) && has_value)
+        {
+            options->timings_csv_filepath = argv[++i];
+        }
+        else if ((strcmp(argv[i], "--timings-json") == 0) && has_value)
+        {
+            options->timings_json_filepath = argv[++i];
+        }
+        else if ((strcmp(argv[i], "--builder") == 0) && has_value)
+        {
+            const char *name = argv[++i];
+            if (strcmp(name, "variance") == 0)
+            {
+                options->build_method = BVH::BuildMethod::VARIANCE;
+            }
+            else if (strcmp(name, "spatial-split") == 0)
+            {
+                options->build_method = BVH::BuildMethod::SPATIAL_SPLIT;
+            }
+            else if (strcmp(name, "ploc") == 0)
+            {
+                options->build_method = BVH::BuildMethod::PLOC;
+            }
+            else
+            {
+                return false;
+            }
+        }
+        else if ((strcmp(argv[i], "--node-order") == 0) && has_value)
         {
-            // Map t from [0, inf[ to [0, 1[
-            // https://math.stackexchange.com/a/3200751/691043
-            float t_normalized = std::atan(t) / (3.14 / 2);
-            unsigned char pixel_color = (t_normalized * t_normalized) * 255;
-            pixels[pixel_x + pixel_y * width] = {255, pixel_color, pixel_color, pixel_color};
+            const char *name = argv[++i];
+            if (strcmp(name, "allocation") == 0)
+            {
+                options->node_order = BVH::NodeOrder::ALLOCATION;
+            }
+            else if (strcmp(name, "depth-first") == 0)
+            {
+                options->node_order = BVH::NodeOrder::DEPTH_FIRST;
+            }
+            else if (strcmp(name, "clustered") == 0)
+            {
+                options->node_order = BVH::NodeOrder::SUBTREE_CLUSTERED;
+            }
+            else
+            {
+                return false;
+            }
+        }
+        else if ((strcmp(argv[i], "--treelet-passes") == 0) && has_value)
+        {
+            options->treelet_passes = atoi(argv[++i]);
+        }
+        else if ((strcmp(argv[i], "--reinsertion-passes") == 0) && has_value)
+        {
+            options->reinsertion_passes = atoi(argv[++i]);
+        }
+        else if ((strcmp(argv[i], "--dump") == 0) && has_value)
+        {
+            options->dump_filepath = argv[++i];
+        }
+        else if ((argv[i][0] != '-') && (options->mesh_filepath == nullptr))
+        {
+            options->mesh_filepath = argv[i];
         }
         else
         {
-            pixels[pixel_x + pixel_y * width] = {255, 0, 0, 0};
+            return false;
         }
     }
-    auto t2 = std::chrono::high_resolution_clock::now();
-    auto frame_time_ns = (t2 - t1).count();
-    total_time_ns += frame_time_ns;
-    num_frames++;
-    std::cout << "Rendering took: " << frame_time_ns / 1'000'000 << " milli seconds" << std::endl;
+
+    return (options->mesh_filepath != nullptr) && (options->num_frames > 0) && (options->num_warmup_frames >= 0) &&
+           (options->width > 0) && (options->height > 0) && (heatmap_max_cost > 0.0f) && (num_ao_samples > 0) && (ao_distance > 0.0f) &&
+           (options->target_frame_ms > 0.0) && (options->treelet_passes >= 0) &&
+           (options->reinsertion_passes >= 0);
+}
+
+// Largest factor adaptive mode divides the window resolution by
+constexpr int MAX_ADAPTIVE_SCALE = 8;
+
+// Factor to divide the resolution of the next frame by in adaptive mode. While the camera moves the factor follows
+// the time the last frame took, each step changes the number of traced pixels by 4x, once the camera stops
+// it steps back down every frame, which progressively refines the still image to full resolution
+static int calc_adaptive_scale(int scale, double last_frame_ms, double target_frame_ms, bool is_camera_moving)
+{
+    if (!is_camera_moving)
+    {
+        return std::max(scale / 2, 1);
+    }
+    if ((last_frame_ms > target_frame_ms) && (scale < MAX_ADAPTIVE_SCALE))
+    {
+        return scale * 2;
+    }
+    if ((last_frame_ms * 4 < target_frame_ms) && (scale > 1))
+    {
+        return scale / 2;
+    }
+    return scale;
+}
+
+// Pixels traced for one frame, width and height may be smaller than the window's in adaptive mode
+struct FrameBuffer
+{
+    std::vector<Color> pixels;
+    int width = WINDOW_WIDTH;
+    int height = WINDOW_HEIGHT;
+    FrameTimings timings;
+};
+
+static void render_frame(FrameBuffer *frame, const BVH::AABBTree &bvh, const Camera &camera, int scale, RenderMode mode)
+{
+    frame->width = (WINDOW_WIDTH + scale - 1) / scale;
+    frame->height = (WINDOW_HEIGHT + scale - 1) / scale;
+    render(frame->pixels.data(), bvh, camera, frame->width, frame->height, mode, &frame->timings);
+}
+
+// Writes the files requested by --timings-csv and --timings-json
+static void write_frame_timings(const Options &options, const std::vector<FrameTimings> &timings)
+{
+    if (options.timings_csv_filepath != nullptr)
+    {
+        write_frame_timings_csv(options.timings_csv_filepath, timings);
+    }
+    if (options.timings_json_filepath != nullptr)
+    {
+        std::ofstream file(options.timings_json_filepath);
+        if (!file)
+        {
+            throw std::runtime_error("Failed to open file");
+        }
+        file << "{\n";
+        file << "  \"frames\": " << timings.size() << ",\n";
+        write_frame_timings_json(file, timings, "  ");
+        file << "\n}" << std::endl;
+    }
+}
+
+// Camera orbiting the origin at the same distance as the interactive start position,
+// bobbing up and down so views from above and below are part of the benchmark too
+static Camera calc_scripted_camera(int frame, int num_frames)
+{
+    float angle = 2 * 3.14159265f * frame / num_frames;
+    Vector4 pos(2 * std::sin(angle), -2 * std::cos(angle), 0.5f * std::sin(2 * angle));
+    return Camera(pos, {0, 0, 0});
+}
+
+static Camera calc_replay_camera(const std::vector<CameraPose> &poses, int frame)
+{
+    Camera camera = make_start_camera();
+    set_camera_pose(&camera, poses[frame % poses.size()]);
+    return camera;
+}
+
+// Tail percentiles of every stage, a few slow frames are more noticeable than a slightly higher mean
+static void print_frame_timings_summary(const std::vector<FrameTimings> &timings)
+{
+    const char *names[] = {"raygen", "trace", "present", "frame"};
+    double FrameTimings::*stages[] = {&FrameTimings::raygen_ms, &FrameTimings::trace_ms, &FrameTimings::present_ms,
+                                      &FrameTimings::total_ms};
+    for (int i = 0; i < 4; i++)
+    {
+        FrameTimeSummary summary = summarize_frame_times(get_stage_times(timings, stages[i]));
+        std::cout << names[i] << " milliseconds: mean = " << summary.mean_ms << ", p50 = " << summary.p50_ms
+                  << ", p95 = " << summary.p95_ms << ", p99 = " << summary.p99_ms << ", max = " << summary.max_ms
+                  << std::endl;
+    }
+}
+
+// Renders a scripted or replayed camera path without SDL and writes timings as JSON to stdout
+static int run_headless(const BVH::AABBTree &bvh, size_t num_tris, Options options,
+                        const std::vector<CameraPose> &replay_poses)
+{
+    print_frame_times = false;
+    std::vector<Color> pixels(options.width * options.height);
+    if (!replay_poses.empty())
+    {
+        options.num_frames = replay_poses.size();
+    }
+    auto calc_camera = [&](int frame)
+    {
+        return replay_poses.empty() ? calc_scripted_camera(frame, options.num_frames) : calc_replay_camera(replay_poses, frame);
+    };
+
+    FrameTimings warmup_timings;
+    for (int i = 0; i < options.num_warmup_frames; i++)
+    {
+        render(pixels.data(), bvh, calc_camera(i), options.width, options.height, options.mode, &warmup_timings);
+    }
+
+    std::vector<FrameTimings> timings(options.num_frames);
+    BVH::TraversalCounters total_counters;
+    double num_rays = 0.0;
+    for (int i = 0; i < options.num_frames; i++)
+    {
+        render(pixels.data(), bvh, calc_camera(i), options.width, options.height, options.mode, &timings[i]);
+        total_counters.merge(frame_counters);
+        num_rays += frame_num_rays;
+    }
+
+    if (options.dump_filepath != nullptr)
+    {
+        write_ppm(options.dump_filepath, pixels.data(), options.width, options.height);
+    }
+
+    write_frame_timings(options, timings);
+
+    std::vector<double> frame_times_ms = get_stage_times(timings, &FrameTimings::total_ms);
+    FrameTimeSummary summary = summarize_frame_times(frame_times_ms);
+
+    std::cout << "{\n";
+    std::cout << "  \"mesh\": \"" << escape_json(options.mesh_filepath) << "\",\n";
+    std::cout << "  \"triangles\": " << num_tris << ",\n";
+    std::cout << "  \"width\": " << options.width << ",\n";
+    std::cout << "  \"height\": " << options.height << ",\n";
+    std::cout << "  \"frames\": " << options.num_frames << ",\n";
+    std::cout << "  \"rays_per_second\": " << num_rays / (summary.total_ms / 1000.0) << ",\n";
+    write_frame_timings_json(std::cout, timings, "  ");
+    std::cout << ",\n";
+#ifdef BVH_TRAVERSAL_COUNTERS
+    double inv_num_rays = 1.0 / std::max<uint64_t>(total_counters.num_rays, 1);
+    std::cout << "  \"traversal\": {\"nodes_per_ray\": " << total_counters.nodes_visited * inv_num_rays
+              << ", \"boxes_per_ray\": " << total_counters.boxes_tested * inv_num_rays
+              << ", \"triangles_per_ray\": " << total_counters.triangles_tested * inv_num_rays
+              << ", \"max_stack_depth\": " << total_counters.max_stack_depth << "},\n";
+#endif
+    std::cout << "  \"frame_times_ms\": ";
+    write_json_array(std::cout, frame_times_ms);
+    std::cout << "\n}" << std::endl;
+
+    return 0;
 }
 
 int main(int argc, char *argv[])
 {
-    if (argc != 2)
+    Options options;
+    if (!parse_options(argc, argv, &options))
+    {
+        puts("Expected arguments: [--headless [--frames N] [--warmup N] [--width W] [--height H] [--dump image.ppm]] "
+             "[--record path.txt] [--replay path.txt] [--adaptive [--target-ms MS]] [--heatmap [--heatmap-max COST]] "
+             "[--ao [--ao-samples N] [--ao-distance D]] [--builder variance|spatial-split|ploc] [--treelet-passes N] "
+             "[--reinsertion-passes N] [--node-order allocation|depth-first|clustered] [--timings-csv path.csv] "
+             "[--timings-json path.json] mesh.[stl|tri]");
+        return 1;
+    }
+
+#ifndef BVH_TRAVERSAL_COUNTERS
+    if (options.mode == RenderMode::HEATMAP)
     {
-        puts("Expected arguments: mesh.[stl|tri]");
+        puts("Heatmap mode needs the bvh library built with BVH_TRAVERSAL_COUNTERS");
         return 1;
     }
+#endif
 
-    const char *filepath = argv[1];
+    std::vector<CameraPose> replay_poses;
+    if (options.replay_filepath != nullptr)
+    {
+        replay_poses = read_camera_path(options.replay_filepath);
+    }
+
+    const char *filepath = options.mesh_filepath;
     std::vector<BVH::Triangle> tris = load_bvh_tris_from_mesh_file(filepath, 0.01f);
-    std::cout << "Loaded " << tris.size() << " triangles from " << filepath << std::endl;
-    BVH::AABBTree bvh(tris, 0.001f);
+    // Keep stdout clean for the JSON report in headless mode
+    std::ostream &log = options.is_headless ? std::cerr : std::cout;
+    log << "Loaded " << tris.size() << " triangles from " << filepath << std::endl;
+    BVH::BuildOptions build_options;
+    build_options.method = options.build_method;
+    build_options.treelet_passes = options.treelet_passes;
+    build_options.reinsertion_passes = options.reinsertion_passes;
+    build_options.node_order = options.node_order;
+    BVH::AABBTree bvh(tris, 0.001f, build_options);
+
+    if (options.is_headless)
+    {
+        return run_headless(bvh, tris.size(), options, replay_poses);
+    }
+
     bvh.print_stats();
 
     SDL_Event event;
@@ -107,14 +717,52 @@ int main(int argc, char *argv[])
     SDL_SetRelativeMouseMode(SDL_TRUE);
 
     bool is_running = true;
+    RenderMode mode = options.mode;
+    bool is_dump_requested = false;
+    int scale = 1;
     int32_t dx, dy;
-    auto *pixels = static_cast<Color *>(malloc(WINDOW_WIDTH * WINDOW_HEIGHT * 4));
+
+    // Frame N + 1 is traced into one buffer while frame N is uploaded and presented from the other,
+    // so what is on screen lags camera input by one frame
+    FrameBuffer frames[2];
+    frames[0].pixels.resize(WINDOW_WIDTH * WINDOW_HEIGHT);
+    frames[1].pixels.resize(WINDOW_WIDTH * WINDOW_HEIGHT);
+    int presented_frame = 0;
+    RenderThread render_thread;
+    std::vector<CameraPose> recorded_poses;
+    size_t num_replayed_frames = 0;
+    std::vector<FrameTimings> timings;
+
+    // Camera and mode are captured by value, input handling keeps changing them while the frame is traced,
+    // returns false instead once a replayed camera path is over
+    auto start_frame = [&](FrameBuffer *frame)
+    {
+        if (!replay_poses.empty())
+        {
+            if (num_replayed_frames == replay_poses.size())
+            {
+                return false;
+            }
+            set_camera_pose(&cam, replay_poses[num_replayed_frames++]);
+        }
+        if (options.record_filepath != nullptr)
+        {
+            recorded_poses.push_back(get_camera_pose(cam));
+        }
+        render_thread.start([&bvh, frame, camera = cam, scale, mode]() {
+            render_frame(frame, bvh, camera, scale, mode);
+        });
+        return true;
+    };
+    start_frame(&frames[0]);
 
     SDL_Texture *buffer = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING,
                                             WINDOW_WIDTH, WINDOW_HEIGHT);
+    auto last_present_end = std::chrono::steady_clock::now();
 
     while (true)
     {
+        bool is_camera_moving = false;
         while (SDL_PollEvent(&event) != 0)
         {
             Vector4 up;
@@ -131,6 +779,7 @@ int main(int argc, char *argv[])
                 dx = event.motion.xrel;
                 dy = event.motion.yrel;
                 cam.rotate(dx * ROTATION_SPEED, dy * ROTATION_SPEED);
+                is_camera_moving = true;
                 break;
             case SDL_KEYDOWN:
                 if (event.key.keysym.sym == SDLK_ESCAPE)
@@ -140,18 +789,38 @@ int main(int argc, char *argv[])
                 else if (event.key.keysym.sym == SDLK_w)
                 {
                     cam.move(forward * MOVEMENT_SPEED);
+                    is_camera_moving = true;
                 }
                 else if (event.key.keysym.sym == SDLK_s)
                 {
                     cam.move(forward * MOVEMENT_SPEED * -1);
+                    is_camera_moving = true;
                 }
                 else if (event.key.keysym.sym == SDLK_a)
                 {
                     cam.move(right * MOVEMENT_SPEED * -1);
+                    is_camera_moving = true;
                 }
                 else if (event.key.keysym.sym == SDLK_d)
                 {
                     cam.move(right * MOVEMENT_SPEED);
+                    is_camera_moving = true;
+                }
+                else if (event.key.keysym.sym == SDLK_h)
+                {
+#ifdef BVH_TRAVERSAL_COUNTERS
+                    mode = (mode == RenderMode::HEATMAP) ? RenderMode::DEPTH : RenderMode::HEATMAP;
+#else
+                    std::cout << "Heatmap mode needs the bvh library built with BVH_TRAVERSAL_COUNTERS" << std::endl;
+#endif
+                }
+                else if (event.key.keysym.sym == SDLK_o)
+                {
+                    mode = (mode == RenderMode::AMBIENT_OCCLUSION) ? RenderMode::DEPTH : RenderMode::AMBIENT_OCCLUSION;
+                }
+                else if (event.key.keysym.sym == SDLK_p)
+                {
+                    is_dump_requested = true;
                 }
                 break;
             }
@@ -160,19 +829,56 @@ int main(int argc, char *argv[])
         if (!is_running)
             break;
 
+        render_thread.wait();
+        const FrameBuffer &frame = frames[presented_frame];
+        if (options.is_adaptive)
+        {
+            scale = calc_adaptive_scale(scale, frame.timings.total_ms, options.target_frame_ms, is_camera_moving);
+        }
+        bool has_next_frame = start_frame(&frames[1 - presented_frame]);
+
+        if (is_dump_requested)
+        {
+            write_ppm("frame.ppm", frame.pixels.data(), frame.width, frame.height);
+            std::cout << "Saved frame.ppm" << std::endl;
+            is_dump_requested = false;
+        }
+
+        // Reduced resolution frames occupy the top left corner of the texture and are stretched over the window
+        auto present_start = std::chrono::steady_clock::now();
+        SDL_Rect frame_rect = {0, 0, frame.width, frame.height};
         SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
         SDL_RenderClear(renderer);
-        render(pixels, bvh, WINDOW_WIDTH, WINDOW_HEIGHT);
-        SDL_UpdateTexture(buffer, nullptr, pixels, WINDOW_WIDTH * 4);
-        SDL_RenderCopy(renderer, buffer, nullptr, nullptr);
+        SDL_UpdateTexture(buffer, &frame_rect, frame.pixels.data(), frame.width * 4);
+        SDL_RenderCopy(renderer, buffer, &frame_rect, nullptr);
         SDL_RenderPresent(renderer);
+        auto present_end = std::chrono::steady_clock::now();
+
+        // Tracing of the next frame overlaps presentation, so the frame time users see is the interval between presents
+        FrameTimings frame_timings = frame.timings;
+        frame_timings.present_ms = std::chrono::duration<double, std::milli>(present_end - present_start).count();
+        frame_timings.total_ms = std::chrono::duration<double, std::milli>(present_end - last_present_end).count();
+        timings.push_back(frame_timings);
+        last_present_end = present_end;
+        presented_frame = 1 - presented_frame;
+        if (!has_next_frame)
+        {
+            break;
+        }
     }
+    render_thread.wait();
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
-    free(pixels);
 
-    std::cout << "Avreage milliseconds per frame = " << (total_time_ns / num_frames) / 1'000'000 << std::endl;
+    if (options.record_filepath != nullptr)
+    {
+        write_camera_path(options.record_filepath, recorded_poses);
+        std::cout << "Recorded " << recorded_poses.size() << " frames to " << options.record_filepath << std::endl;
+    }
+
+    write_frame_timings(options, timings);
+    print_frame_timings_summary(timings);
 
     return 0;
 }
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <stdexcept>
+#include <vector>
+
+#include "bvh.hpp"
+#include "utils.hpp"
+#include "vec4.hpp"
+
+namespace BVH
+{
+
+    void AABBTree::update_vertices(const std::vector<Triangle> &tris)
+    {
+        if (tris.size() != num_input_tris)
+        {
+            throw std::invalid_argument("Number of triangles does not match the tree");
+        }
+
+#pragma omp parallel for if (tri_indices.size() >= 4096)
+        for (int i = 0; i < (int)tri_indices.size(); i++)
+        {
+            this->tris[i] = tris[tri_indices[i]];
+        }
+    }
+
+    void AABBTree::calc_refit_levels()
+    {
+        refit_levels.clear();
+        refit_levels.push_back({root});
+        while (true)
+        {
+            std::vector<Node *> next_level;
+            for (Node *node : refit_levels.back())
+            {
+                if (!node->is_leaf())
+                {
+                    next_level.push_back(node->left);
+                    next_level.push_back(node->right);
+                }
+            }
+            if (next_level.empty())
+            {
+                break;
+            }
+            refit_levels.push_back(std::move(next_level));
+        }
+    }
+
+    bool AABBTree::refit(float rebuild_threshold)
+    {
+        if (refit_levels.empty())
+        {
+            calc_refit_levels();
+        }
+
+        // Deepest level first, so children are always up to date before their parents,
+        // nodes within a level are independent of each other
+        for (int depth = (int)refit_levels.size() - 1; depth >= 0; depth--)
+        {
+            const std::vector<Node *> &level = refit_levels[depth];
+#pragma omp parallel for if (level.size() >= 256)
+            for (int i = 0; i < (int)level.size(); i++)
+            {
+                Node *node = level[i];
+                if (node->is_leaf())
+                {
+                    Vector4 upper = node->begin->vertices[0];
+                    Vector4 lower = upper;
+                    for (auto it = node->begin; it != node->end; ++it)
+                    {
+                        for (auto vertex : it->vertices)
+                        {
+                            upper = upper.max(vertex);
+                            lower = lower.min(vertex);
+                        }
+                    }
+                    node->aabb.upper = upper + Vector4(aabb_expansion);
+                    node->aabb.lower = lower - Vector4(aabb_expansion);
+                }
+                else
+                {
+                    node->aabb.upper = node->left->aabb.upper.max(node->right->aabb.upper);
+                    node->aabb.lower = node->left->aabb.lower.min(node->right->aabb.lower);
+                }
+            }
+        }
+
+        if ((rebuild_threshold > 0.0f) && (calc_sah_cost(root) > built_sah_cost * rebuild_threshold))
+        {
+            build();
+            return true;
+        }
+
+        return false;
+    }
+
+}
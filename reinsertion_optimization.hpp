@@ -0,0 +1,273 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <functional>
+#include <queue>
+#include <utility>
+#include <vector>
+
+#include "bvh.hpp"
+#include "utils.hpp"
+#include "vec4.hpp"
+
+namespace BVH
+{
+
+    // Insertion-based optimization, see "Fast Insertion-Based Optimization of Bounding Volume Hierarchies"
+    // (Bittner et al. 2013). Each pass takes the inner nodes that look the most misplaced, removes each from the tree
+    // together with its parent and inserts its two children back separately, each as the sibling of whichever node
+    // that costs the least, found by branch and bound. The removed node and its parent become the children's new
+    // parents, so the number of nodes never changes
+    class ReinsertionOptimizer
+    {
+    private:
+        // Fraction of nodes reinserted by each pass
+        static constexpr float BATCH_FRACTION = 0.05f;
+        // Keeps the inefficiency of nodes over degenerate, flat or empty, children finite
+        static constexpr float MIN_CHILD_AREA = 1e-12f;
+        // Relative SAH improvement a pass needs for the next pass to run, later passes tend to pick the same
+        // nodes and put them back where they were
+        static constexpr float MIN_IMPROVEMENT = 1e-4f;
+
+        AABBTree &tree;
+        // Parent of each node, indexed by position in the node pool, nullptr for the root. Kept here rather than
+        // in Node so that nodes stay one cache line for builders and traversal that do not need it
+        std::vector<Node *> parents;
+
+        Node *&parent_of(Node *node);
+        void calc_parents();
+        std::vector<Node *> collect_candidates();
+        void replace_child(Node *parent, Node *old_child, Node *new_child);
+        void refit_ancestors(Node *node);
+        void remove(Node *node);
+        Node *find_best_sibling(const AABB &aabb) const;
+        void insert(Node *node, Node *new_parent, Node *sibling);
+
+    public:
+        explicit ReinsertionOptimizer(AABBTree &tree);
+
+        // Returns the number of nodes that were reinserted
+        size_t optimize(int num_passes);
+    };
+
+    ReinsertionOptimizer::ReinsertionOptimizer(AABBTree &tree) : tree(tree)
+    {
+    }
+
+    Node *&ReinsertionOptimizer::parent_of(Node *node)
+    {
+        return parents[node - tree.preallocated_nodes];
+    }
+
+    void ReinsertionOptimizer::calc_parents()
+    {
+        parents.assign(tree.num_used_nodes, nullptr);
+        std::vector<Node *> stack = {tree.root};
+        while (!stack.empty())
+        {
+            Node *node = stack.back();
+            stack.pop_back();
+            if (!node->is_leaf())
+            {
+                parent_of(node->left) = node;
+                parent_of(node->right) = node;
+                stack.push_back(node->left);
+                stack.push_back(node->right);
+            }
+        }
+    }
+
+    // Inner nodes sorted by decreasing inefficiency, the product of the node's area and how much larger it is
+    // than its smallest child and than both children together. Large nodes alone are always the top of the tree,
+    // which is already where it belongs, a large node over small children is one whose children are far apart.
+    // Children of the root are left out since moving them only reshuffles the top of the tree
+    std::vector<Node *> ReinsertionOptimizer::collect_candidates()
+    {
+        std::vector<std::pair<float, Node *>> nodes;
+        std::vector<Node *> stack = {tree.root};
+        while (!stack.empty())
+        {
+            Node *node = stack.back();
+            stack.pop_back();
+            if (node->is_leaf())
+            {
+                continue;
+            }
+            if ((parent_of(node) != nullptr) && (parent_of(node) != tree.root))
+            {
+                float area = calc_surface_area(node->aabb);
+                float left_area = calc_surface_area(node->left->aabb);
+                float right_area = calc_surface_area(node->right->aabb);
+                float min_child_area = std::max(std::min(left_area, right_area), MIN_CHILD_AREA);
+                float sum_child_areas = std::max(left_area + right_area, MIN_CHILD_AREA);
+                nodes.push_back({area * (area / min_child_area) * (area / sum_child_areas), node});
+            }
+            stack.push_back(node->left);
+            stack.push_back(node->right);
+        }
+
+        size_t num_candidates = std::max<size_t>(1, static_cast<size_t>(nodes.size() * BATCH_FRACTION));
+        num_candidates = std::min(num_candidates, nodes.size());
+        std::partial_sort(nodes.begin(), nodes.begin() + num_candidates, nodes.end(),
+                          std::greater<std::pair<float, Node *>>());
+
+        std::vector<Node *> candidates(num_candidates);
+        for (size_t i = 0; i < num_candidates; i++)
+        {
+            candidates[i] = nodes[i].second;
+        }
+        return candidates;
+    }
+
+    void ReinsertionOptimizer::replace_child(Node *parent, Node *old_child, Node *new_child)
+    {
+        if (parent == nullptr)
+        {
+            tree.root = new_child;
+        }
+        else if (parent->left == old_child)
+        {
+            parent->left = new_child;
+        }
+        else
+        {
+            assert(parent->right == old_child);
+            parent->right = new_child;
+        }
+        parent_of(new_child) = parent;
+    }
+
+    void ReinsertionOptimizer::refit_ancestors(Node *node)
+    {
+        while (node != nullptr)
+        {
+            node->aabb = merge_aabbs(node->left->aabb, node->right->aabb);
+            node = parent_of(node);
+        }
+    }
+
+    // Detaches node and its parent from the tree, the node's sibling takes the parent's place,
+    // the parent keeps its children so that it can be reused when the node is inserted again
+    void ReinsertionOptimizer::remove(Node *node)
+    {
+        Node *parent = parent_of(node);
+        Node *sibling = (parent->left == node) ? parent->right : parent->left;
+        Node *grand_parent = parent_of(parent);
+        replace_child(grand_parent, parent, sibling);
+        refit_ancestors(grand_parent);
+    }
+
+    // Branch and bound search for the node that minimizes the total surface area added to the tree when it becomes
+    // the sibling of a node with the given bounds, same as DynamicAABBTree::find_best_sibling
+    Node *ReinsertionOptimizer::find_best_sibling(const AABB &aabb) const
+    {
+        float area = calc_surface_area(aabb);
+
+        Node *best = tree.root;
+        float best_cost = calc_surface_area(merge_aabbs(tree.root->aabb, aabb));
+
+        // Pairs of (area inherited from ancestors, node), smallest inherited area first
+        using Candidate = std::pair<float, Node *>;
+        std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> queue;
+        queue.push({0.0f, tree.root});
+        while (!queue.empty())
+        {
+            float inherited = queue.top().first;
+            Node *node = queue.top().second;
+            queue.pop();
+
+            float direct = calc_surface_area(merge_aabbs(node->aabb, aabb));
+            if (direct + inherited < best_cost)
+            {
+                best = node;
+                best_cost = direct + inherited;
+            }
+
+            if (node->is_leaf())
+            {
+                continue;
+            }
+
+            // Going one level deeper, this node will grow to enclose the inserted one
+            float child_inherited = inherited + direct - calc_surface_area(node->aabb);
+            if (area + child_inherited < best_cost)
+            {
+                queue.push({child_inherited, node->left});
+                queue.push({child_inherited, node->right});
+            }
+        }
+
+        return best;
+    }
+
+    void ReinsertionOptimizer::insert(Node *node, Node *new_parent, Node *sibling)
+    {
+        replace_child(parent_of(sibling), sibling, new_parent);
+        new_parent->left = sibling;
+        new_parent->right = node;
+        parent_of(sibling) = new_parent;
+        parent_of(node) = new_parent;
+        refit_ancestors(new_parent);
+    }
+
+    size_t ReinsertionOptimizer::optimize(int num_passes)
+    {
+        calc_parents();
+        size_t num_reinserted = 0;
+        float cost = calc_sah_cost(tree.root);
+        // Tree before the current pass, reinsertion only relinks and refits nodes already in use
+        std::vector<Node> saved_nodes;
+        std::vector<Node *> saved_parents;
+        Node *saved_root = nullptr;
+        for (int pass = 0; pass < num_passes; pass++)
+        {
+            saved_nodes.assign(tree.preallocated_nodes, tree.preallocated_nodes + tree.num_used_nodes);
+            saved_parents = parents;
+            saved_root = tree.root;
+
+            size_t num_reinserted_now = 0;
+            for (Node *node : collect_candidates())
+            {
+                // An earlier reinsertion in the same pass may have moved the node next to the root
+                Node *parent = parent_of(node);
+                if ((parent == nullptr) || (parent_of(parent) == nullptr))
+                {
+                    continue;
+                }
+
+                // Larger child first, it has fewer good places to go
+                Node *children[2] = {node->left, node->right};
+                if (calc_surface_area(children[0]->aabb) < calc_surface_area(children[1]->aabb))
+                {
+                    std::swap(children[0], children[1]);
+                }
+                Node *free_nodes[2] = {node, parent};
+                remove(node);
+                for (int i = 0; i < 2; i++)
+                {
+                    insert(children[i], free_nodes[i], find_best_sibling(children[i]->aabb));
+                }
+                num_reinserted_now += 2;
+            }
+
+            // Each reinsertion is locally greedy, together they can leave the tree worse than before the pass
+            float new_cost = calc_sah_cost(tree.root);
+            if (new_cost >= cost)
+            {
+                std::copy(saved_nodes.begin(), saved_nodes.end(), tree.preallocated_nodes);
+                parents.swap(saved_parents);
+                tree.root = saved_root;
+                break;
+            }
+            num_reinserted += num_reinserted_now;
+            if (new_cost > cost * (1.0f - MIN_IMPROVEMENT))
+            {
+                break;
+            }
+            cost = new_cost;
+        }
+        return num_reinserted;
+    }
+
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "non_copyable.hpp"
+
+// Runs one job at a time on a persistent background thread, so a frame can be traced while the main thread
+// presents the previous one. The thread lives as long as this object because OpenMP keeps a pool of worker
+// threads per thread that opens parallel regions, a fresh thread per frame would rebuild that pool every frame
+class RenderThread : public NonCopyable
+{
+private:
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::function<void()> job;
+    bool has_job = false;
+    bool is_stopping = false;
+    // Declared last so that it starts after the members it uses are initialized
+    std::thread thread;
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            condition.wait(lock, [this]() { return has_job || is_stopping; });
+            if (!has_job)
+            {
+                return;
+            }
+
+            lock.unlock();
+            job();
+            lock.lock();
+            has_job = false;
+            condition.notify_all();
+        }
+    }
+
+public:
+    RenderThread() : thread([this]() { run(); })
+    {
+    }
+
+    ~RenderThread()
+    {
+        wait();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            is_stopping = true;
+        }
+        condition.notify_all();
+        thread.join();
+    }
+
+    // Waits for the previous job, if any, before handing over the new one
+    void start(std::function<void()> new_job)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.wait(lock, [this]() { return !has_job; });
+        job = std::move(new_job);
+        has_job = true;
+        condition.notify_all();
+    }
+
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.wait(lock, [this]() { return !has_job; });
+    }
+};
@@ -0,0 +1,475 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "bvh.hpp"
+#include "clipping.hpp"
+#include "utils.hpp"
+#include "vec4.hpp"
+
+namespace BVH
+{
+
+    size_t calc_max_spatial_split_duplicates(size_t num_tris, float budget)
+    {
+        return static_cast<size_t>(std::fmax(budget, 0.0f) * num_tris);
+    }
+
+    struct SpatialSplitReference
+    {
+        AABB aabb;
+        uint32_t tri;
+    };
+
+    // Spatial split BVH builder, see "Spatial Splits in Bounding Volume Hierarchies" (Stich et al. 2009),
+    // both object and spatial splits are evaluated with binned SAH,
+    // spatial splits are only tried where the best object split leaves overlapping children
+    class SpatialSplitBuilder
+    {
+    private:
+        static constexpr int NUM_BINS = 32;
+        static constexpr int MAX_LEAF_SIZE = 4;
+        // Minimum child overlap, relative to the root's surface area, for spatial splits to be considered
+        static constexpr float MIN_OVERLAP = 1e-5f;
+
+        struct Split
+        {
+            float cost = std::numeric_limits<float>::max();
+            int axis = -1;
+            // Object splits go by centroid bin (bin index relative to pos), spatial splits by plane position
+            int bin = 0;
+            float pos = 0.0f;
+            float inv_bin_size = 0.0f;
+            AABB left_aabb, right_aabb;
+            int num_left = 0, num_right = 0;
+        };
+
+        AABBTree &tree;
+        std::vector<Triangle> input_tris;
+        std::vector<uint32_t> input_indices;
+        size_t num_duplicates_left;
+        float root_area = 0.0f;
+
+        static AABB calc_references_aabb(const std::vector<SpatialSplitReference> &refs);
+        static int calc_bin(float value, float lower, float inv_bin_size);
+        Split find_object_split(const std::vector<SpatialSplitReference> &refs, const AABB &aabb) const;
+        Split find_spatial_split(const std::vector<SpatialSplitReference> &refs, const AABB &aabb) const;
+        bool clip_reference(const SpatialSplitReference &ref, const AABB &box, SpatialSplitReference *out) const;
+        void split_spatially(const std::vector<SpatialSplitReference> &refs, const Split &split,
+                             std::vector<SpatialSplitReference> *left, std::vector<SpatialSplitReference> *right);
+        Node *build_node(std::vector<SpatialSplitReference> &refs, int depth);
+        Node *make_leaf(const std::vector<SpatialSplitReference> &refs, const AABB &aabb);
+
+    public:
+        explicit SpatialSplitBuilder(AABBTree &tree);
+
+        void build();
+    };
+
+    SpatialSplitBuilder::SpatialSplitBuilder(AABBTree &tree)
+        : tree(tree),
+          num_duplicates_left(calc_max_spatial_split_duplicates(tree.num_input_tris, tree.options.spatial_split_budget))
+    {
+    }
+
+    AABB SpatialSplitBuilder::calc_references_aabb(const std::vector<SpatialSplitReference> &refs)
+    {
+        AABB aabb = refs[0].aabb;
+        for (const auto &ref : refs)
+        {
+            aabb = merge_aabbs(aabb, ref.aabb);
+        }
+        return aabb;
+    }
+
+    int SpatialSplitBuilder::calc_bin(float value, float lower, float inv_bin_size)
+    {
+        int bin = static_cast<int>((value - lower) * inv_bin_size);
+        return std::min(std::max(bin, 0), NUM_BINS - 1);
+    }
+
+    SpatialSplitBuilder::Split SpatialSplitBuilder::find_object_split(const std::vector<SpatialSplitReference> &refs,
+                                                                      const AABB &aabb) const
+    {
+        Vector4 centroid_upper = (refs[0].aabb.upper + refs[0].aabb.lower) * 0.5f;
+        Vector4 centroid_lower = centroid_upper;
+        for (const auto &ref : refs)
+        {
+            Vector4 centroid = (ref.aabb.upper + ref.aabb.lower) * 0.5f;
+            centroid_upper = centroid_upper.max(centroid);
+            centroid_lower = centroid_lower.min(centroid);
+        }
+
+        float node_area = calc_surface_area(aabb);
+        Split best;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            float extent = centroid_upper[axis] - centroid_lower[axis];
+            if (extent <= 0.0f)
+            {
+                continue;
+            }
+
+            float inv_bin_size = NUM_BINS / extent;
+            AABB bin_aabbs[NUM_BINS];
+            int bin_counts[NUM_BINS] = {};
+            for (const auto &ref : refs)
+            {
+                float centroid = (ref.aabb.upper[axis] + ref.aabb.lower[axis]) * 0.5f;
+                int bin = calc_bin(centroid, centroid_lower[axis], inv_bin_size);
+                bin_aabbs[bin] = bin_counts[bin] ? merge_aabbs(bin_aabbs[bin], ref.aabb) : ref.aabb;
+                bin_counts[bin]++;
+            }
+
+            // Sweep from the right to get the right side of every candidate plane, then from the left
+            AABB right_aabbs[NUM_BINS];
+            int right_counts[NUM_BINS] = {};
+            AABB accumulated;
+            int count = 0;
+            for (int i = NUM_BINS - 1; i > 0; i--)
+            {
+                if (bin_counts[i])
+                {
+                    accumulated = count ? merge_aabbs(accumulated, bin_aabbs[i]) : bin_aabbs[i];
+                    count += bin_counts[i];
+                }
+                right_aabbs[i] = accumulated;
+                right_counts[i] = count;
+            }
+
+            count = 0;
+            for (int i = 1; i < NUM_BINS; i++)
+            {
+                if (bin_counts[i - 1])
+                {
+                    accumulated = count ? merge_aabbs(accumulated, bin_aabbs[i - 1]) : bin_aabbs[i - 1];
+                    count += bin_counts[i - 1];
+                }
+                if ((count == 0) || (right_counts[i] == 0))
+                {
+                    continue;
+                }
+                float cost = 1.0f + (calc_surface_area(accumulated) * count +
+                                     calc_surface_area(right_aabbs[i]) * right_counts[i]) /
+                                        node_area;
+                if (cost < best.cost)
+                {
+                    best.cost = cost;
+                    best.axis = axis;
+                    best.bin = i;
+                    best.pos = centroid_lower[axis];
+                    best.inv_bin_size = inv_bin_size;
+                    best.left_aabb = accumulated;
+                    best.right_aabb = right_aabbs[i];
+                    best.num_left = count;
+                    best.num_right = right_counts[i];
+                }
+            }
+        }
+
+        return best;
+    }
+
+    bool SpatialSplitBuilder::clip_reference(const SpatialSplitReference &ref, const AABB &box,
+                                             SpatialSplitReference *out) const
+    {
+        AABB clip_box;
+        clip_box.upper = ref.aabb.upper.min(box.upper);
+        clip_box.lower = ref.aabb.lower.max(box.lower);
+
+        Vector4 polygon[MAX_CLIPPED_POLYGON_VERTICES];
+        int num_vertices = clip_triangle_to_aabb(input_tris[ref.tri], clip_box, polygon);
+        if (num_vertices == 0)
+        {
+            return false;
+        }
+
+        out->aabb = calc_polygon_aabb(polygon, num_vertices);
+        out->tri = ref.tri;
+        return true;
+    }
+
+    SpatialSplitBuilder::Split SpatialSplitBuilder::find_spatial_split(const std::vector<SpatialSplitReference> &refs,
+                                                                       const AABB &aabb) const
+    {
+        float node_area = calc_surface_area(aabb);
+        Split best;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            float lower = aabb.lower[axis];
+            float extent = aabb.upper[axis] - lower;
+            if (extent <= 0.0f)
+            {
+                continue;
+            }
+
+            float bin_size = extent / NUM_BINS;
+            float inv_bin_size = NUM_BINS / extent;
+            AABB bin_aabbs[NUM_BINS];
+            bool is_bin_empty[NUM_BINS];
+            int entry_counts[NUM_BINS] = {};
+            int exit_counts[NUM_BINS] = {};
+            std::fill(is_bin_empty, is_bin_empty + NUM_BINS, true);
+
+            for (const auto &ref : refs)
+            {
+                int first_bin = calc_bin(ref.aabb.lower[axis], lower, inv_bin_size);
+                int last_bin = calc_bin(ref.aabb.upper[axis], lower, inv_bin_size);
+                entry_counts[first_bin]++;
+                exit_counts[last_bin]++;
+                for (int bin = first_bin; bin <= last_bin; bin++)
+                {
+                    // Only the part of the triangle inside the bin contributes to the bin's bounds
+                    AABB slab = aabb;
+                    slab.lower[axis] = lower + bin * bin_size;
+                    slab.upper[axis] = (bin == NUM_BINS - 1) ? aabb.upper[axis] : lower + (bin + 1) * bin_size;
+                    SpatialSplitReference clipped;
+                    if (!clip_reference(ref, slab, &clipped))
+                    {
+                        continue;
+                    }
+                    bin_aabbs[bin] = is_bin_empty[bin] ? clipped.aabb : merge_aabbs(bin_aabbs[bin], clipped.aabb);
+                    is_bin_empty[bin] = false;
+                }
+            }
+
+            AABB right_aabbs[NUM_BINS];
+            bool is_right_empty[NUM_BINS];
+            int right_counts[NUM_BINS] = {};
+            AABB accumulated;
+            bool is_empty = true;
+            int count = 0;
+            for (int i = NUM_BINS - 1; i > 0; i--)
+            {
+                if (!is_bin_empty[i])
+                {
+                    accumulated = is_empty ? bin_aabbs[i] : merge_aabbs(accumulated, bin_aabbs[i]);
+                    is_empty = false;
+                }
+                count += exit_counts[i];
+                right_aabbs[i] = accumulated;
+                is_right_empty[i] = is_empty;
+                right_counts[i] = count;
+            }
+
+            is_empty = true;
+            count = 0;
+            for (int i = 1; i < NUM_BINS; i++)
+            {
+                if (!is_bin_empty[i - 1])
+                {
+                    accumulated = is_empty ? bin_aabbs[i - 1] : merge_aabbs(accumulated, bin_aabbs[i - 1]);
+                    is_empty = false;
+                }
+                count += entry_counts[i - 1];
+                if (is_empty || is_right_empty[i] || (count == 0) || (right_counts[i] == 0))
+                {
+                    continue;
+                }
+                float cost = 1.0f + (calc_surface_area(accumulated) * count +
+                                     calc_surface_area(right_aabbs[i]) * right_counts[i]) /
+                                        node_area;
+                if (cost < best.cost)
+                {
+                    best.cost = cost;
+                    best.axis = axis;
+                    best.bin = i;
+                    best.pos = lower + i * bin_size;
+                    best.left_aabb = accumulated;
+                    best.right_aabb = right_aabbs[i];
+                    best.num_left = count;
+                    best.num_right = right_counts[i];
+                }
+            }
+        }
+
+        return best;
+    }
+
+    void SpatialSplitBuilder::split_spatially(const std::vector<SpatialSplitReference> &refs, const Split &split,
+                                              std::vector<SpatialSplitReference> *left,
+                                              std::vector<SpatialSplitReference> *right)
+    {
+        int axis = split.axis;
+        float left_area = calc_surface_area(split.left_aabb);
+        float right_area = calc_surface_area(split.right_aabb);
+
+        for (const auto &ref : refs)
+        {
+            if (ref.aabb.upper[axis] <= split.pos)
+            {
+                left->push_back(ref);
+                continue;
+            }
+            if (ref.aabb.lower[axis] >= split.pos)
+            {
+                right->push_back(ref);
+                continue;
+            }
+
+            // Reference unsplitting: keep a straddling reference on one side only
+            // when that is cheaper than duplicating it, or when the duplication budget is used up
+            float split_cost = left_area * split.num_left + right_area * split.num_right;
+            float left_cost = calc_surface_area(merge_aabbs(split.left_aabb, ref.aabb)) * split.num_left +
+                              right_area * (split.num_right - 1);
+            float right_cost = left_area * (split.num_left - 1) +
+                               calc_surface_area(merge_aabbs(split.right_aabb, ref.aabb)) * split.num_right;
+
+            SpatialSplitReference left_ref, right_ref;
+            AABB left_box = ref.aabb;
+            AABB right_box = ref.aabb;
+            left_box.upper[axis] = split.pos;
+            right_box.lower[axis] = split.pos;
+            bool has_left = clip_reference(ref, left_box, &left_ref);
+            bool has_right = clip_reference(ref, right_box, &right_ref);
+
+            if (has_left && has_right && (num_duplicates_left > 0) &&
+                (split_cost < left_cost) && (split_cost < right_cost))
+            {
+                left->push_back(left_ref);
+                right->push_back(right_ref);
+                num_duplicates_left--;
+            }
+            else if ((has_left && (left_cost <= right_cost)) || !has_right)
+            {
+                left->push_back(ref);
+            }
+            else
+            {
+                right->push_back(ref);
+            }
+        }
+    }
+
+    Node *SpatialSplitBuilder::make_leaf(const std::vector<SpatialSplitReference> &refs, const AABB &aabb)
+    {
+        size_t first = tree.tris.size();
+        for (const auto &ref : refs)
+        {
+            tree.tris.push_back(input_tris[ref.tri]);
+            tree.tri_indices.push_back(input_indices[ref.tri]);
+        }
+
+        Node *node = tree.new_node(tree.tris.begin() + first, tree.tris.end());
+        node->aabb.upper = aabb.upper + Vector4(tree.aabb_expansion);
+        node->aabb.lower = aabb.lower - Vector4(tree.aabb_expansion);
+        return node;
+    }
+
+    Node *SpatialSplitBuilder::build_node(std::vector<SpatialSplitReference> &refs, int depth)
+    {
+        assert(!refs.empty());
+
+        AABB aabb = calc_references_aabb(refs);
+        int num_refs = refs.size();
+        if ((num_refs == 1) || (depth >= tree.options.max_depth))
+        {
+            return make_leaf(refs, aabb);
+        }
+
+        Split object_split = find_object_split(refs, aabb);
+        Split split = object_split;
+        bool is_spatial = false;
+
+        if ((num_duplicates_left > 0) && (object_split.axis != -1))
+        {
+            AABB overlap;
+            overlap.upper = object_split.left_aabb.upper.min(object_split.right_aabb.upper);
+            overlap.lower = object_split.left_aabb.lower.max(object_split.right_aabb.lower);
+            Vector4 overlap_extent = overlap.upper - overlap.lower;
+            bool is_overlapping = (overlap_extent.x > 0) && (overlap_extent.y > 0) && (overlap_extent.z > 0);
+            if (is_overlapping && (calc_surface_area(overlap) > MIN_OVERLAP * root_area))
+            {
+                Split spatial_split = find_spatial_split(refs, aabb);
+                if (spatial_split.cost < object_split.cost)
+                {
+                    split = spatial_split;
+                    is_spatial = true;
+                }
+            }
+        }
+
+        if ((num_refs <= MAX_LEAF_SIZE) && (split.cost >= num_refs))
+        {
+            return make_leaf(refs, aabb);
+        }
+
+        std::vector<SpatialSplitReference> left_refs, right_refs;
+        if (is_spatial)
+        {
+            split_spatially(refs, split, &left_refs, &right_refs);
+        }
+        if (!is_spatial || left_refs.empty() || right_refs.empty())
+        {
+            left_refs.clear();
+            right_refs.clear();
+            if (object_split.axis != -1)
+            {
+                int axis = object_split.axis;
+                for (const auto &ref : refs)
+                {
+                    float centroid = (ref.aabb.upper[axis] + ref.aabb.lower[axis]) * 0.5f;
+                    int bin = calc_bin(centroid, object_split.pos, object_split.inv_bin_size);
+                    (bin < object_split.bin ? left_refs : right_refs).push_back(ref);
+                }
+            }
+            if (left_refs.empty() || right_refs.empty())
+            {
+                // No usable split (e.g. all centroids coincide), halve the references as they are
+                left_refs.assign(refs.begin(), refs.begin() + num_refs / 2);
+                right_refs.assign(refs.begin() + num_refs / 2, refs.end());
+            }
+        }
+
+        // References of this node are no longer needed, free them before going deeper
+        std::vector<SpatialSplitReference>().swap(refs);
+
+        Node *node = tree.new_node(tree.tris.end(), tree.tris.end());
+        node->aabb.upper = aabb.upper + Vector4(tree.aabb_expansion);
+        node->aabb.lower = aabb.lower - Vector4(tree.aabb_expansion);
+        node->left = build_node(left_refs, depth + 1);
+        node->right = build_node(right_refs, depth + 1);
+        // Leaves are emitted depth first, so a subtree's triangles are contiguous
+        node->begin = node->left->begin;
+        node->end = node->right->end;
+        return node;
+    }
+
+    void SpatialSplitBuilder::build()
+    {
+        input_tris = std::move(tree.tris);
+        input_indices = std::move(tree.tri_indices);
+
+        std::vector<SpatialSplitReference> refs(input_tris.size());
+        for (size_t i = 0; i < input_tris.size(); i++)
+        {
+            const Triangle &tri = input_tris[i];
+            refs[i].aabb.upper = refs[i].aabb.lower = tri.vertices[0];
+            for (auto vertex : tri.vertices)
+            {
+                refs[i].aabb.upper = refs[i].aabb.upper.max(vertex);
+                refs[i].aabb.lower = refs[i].aabb.lower.min(vertex);
+            }
+            refs[i].tri = i;
+        }
+        root_area = calc_surface_area(calc_references_aabb(refs));
+
+        // Leaves hold iterators into tree.tris, so it must never reallocate while being filled
+        tree.tris.clear();
+        tree.tri_indices.clear();
+        tree.tris.reserve(input_tris.size() + num_duplicates_left);
+        tree.tri_indices.reserve(input_tris.size() + num_duplicates_left);
+        auto *data = tree.tris.data();
+
+        tree.root = build_node(refs, 0);
+
+        assert(tree.tris.data() == data);
+        (void)data;
+    }
+
+}
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "bvh.hpp"
+#include "clipping.hpp"
+#include "utils.hpp"
+#include "vec4.hpp"
+
+namespace BVH
+{
+
+    void collect_node_stats(const Node *node, size_t depth, TreeStats *stats)
+    {
+        stats->num_nodes++;
+        stats->max_depth = std::max(stats->max_depth, depth);
+
+        if (node->is_leaf())
+        {
+            size_t num_tris = std::distance(node->begin, node->end);
+            stats->num_leaves++;
+            stats->max_leaf_tris = std::max(stats->max_leaf_tris, num_tris);
+            if (stats->depth_histogram.size() <= depth)
+            {
+                stats->depth_histogram.resize(depth + 1);
+            }
+            stats->depth_histogram[depth]++;
+            if (stats->leaf_size_histogram.size() <= num_tris)
+            {
+                stats->leaf_size_histogram.resize(num_tris + 1);
+            }
+            stats->leaf_size_histogram[num_tris]++;
+            return;
+        }
+
+        AABB overlap;
+        overlap.upper = node->left->aabb.upper.min(node->right->aabb.upper);
+        overlap.lower = node->left->aabb.lower.max(node->right->aabb.lower);
+        Vector4 extent = overlap.upper - overlap.lower;
+        if ((extent.x > 0) && (extent.y > 0) && (extent.z > 0))
+        {
+            stats->sibling_overlap += calc_surface_area(overlap);
+        }
+
+        collect_node_stats(node->left, depth + 1, stats);
+        collect_node_stats(node->right, depth + 1, stats);
+    }
+
+    bool do_aabbs_overlap(const AABB &a, const AABB &b)
+    {
+        return (a.lower.x <= b.upper.x) && (a.upper.x >= b.lower.x) &&
+               (a.lower.y <= b.upper.y) && (a.upper.y >= b.lower.y) &&
+               (a.lower.z <= b.upper.z) && (a.upper.z >= b.lower.z);
+    }
+
+    float AABBTree::calc_epo() const
+    {
+        // Triangle slots grouped by input triangle, a triangle duplicated by spatial splits
+        // belongs to a node if any of its references does
+        std::vector<std::pair<uint32_t, uint32_t>> slots(tris.size());
+        for (size_t i = 0; i < tris.size(); i++)
+        {
+            slots[i] = {tri_indices[i], i};
+        }
+        std::sort(slots.begin(), slots.end());
+        std::vector<size_t> groups;
+        for (size_t i = 0; i < slots.size(); i++)
+        {
+            if ((i == 0) || (slots[i].first != slots[i - 1].first))
+            {
+                groups.push_back(i);
+            }
+        }
+        groups.push_back(slots.size());
+
+        double overlap_area = 0.0;
+        double total_area = 0.0;
+#pragma omp parallel for schedule(dynamic, 64) reduction(+ : overlap_area, total_area)
+        for (int group = 0; group < (int)groups.size() - 1; group++)
+        {
+            const Triangle &tri = tris[slots[groups[group]].second];
+            AABB tri_aabb;
+            tri_aabb.upper = tri_aabb.lower = tri.vertices[0];
+            for (auto vertex : tri.vertices)
+            {
+                tri_aabb.upper = tri_aabb.upper.max(vertex);
+                tri_aabb.lower = tri_aabb.lower.min(vertex);
+            }
+            total_area += calc_polygon_area(tri.vertices, 3);
+
+            std::vector<const Node *> stack = {root};
+            while (!stack.empty())
+            {
+                const Node *node = stack.back();
+                stack.pop_back();
+                if (!do_aabbs_overlap(node->aabb, tri_aabb))
+                {
+                    continue;
+                }
+
+                bool is_referenced = false;
+                for (size_t i = groups[group]; i < groups[group + 1]; i++)
+                {
+                    auto slot = tris.begin() + slots[i].second;
+                    is_referenced |= (node->begin <= slot) && (slot < node->end);
+                }
+                if (!is_referenced)
+                {
+                    Vector4 polygon[MAX_CLIPPED_POLYGON_VERTICES];
+                    int num_vertices = clip_triangle_to_aabb(tri, node->aabb, polygon);
+                    overlap_area += calc_polygon_area(polygon, num_vertices);
+                }
+
+                if (!node->is_leaf())
+                {
+                    stack.push_back(node->left);
+                    stack.push_back(node->right);
+                }
+            }
+        }
+
+        return (total_area > 0.0) ? overlap_area / total_area : 0.0f;
+    }
+
+    TreeStats AABBTree::calc_stats() const
+    {
+        TreeStats stats;
+        stats.num_tris = num_input_tris;
+        stats.num_tri_references = tris.size();
+        stats.nodes_memory = num_preallocated_nodes * sizeof(Node);
+
+        collect_node_stats(root, 0, &stats);
+        stats.avg_leaf_tris = tris.size() / (float)stats.num_leaves;
+
+        float root_area = calc_surface_area(root->aabb);
+        stats.sibling_overlap = (root_area > 0.0f) ? stats.sibling_overlap / root_area : 0.0f;
+        stats.sah_cost = calc_sah_cost(root);
+        stats.epo = calc_epo();
+        return stats;
+    }
+
+}
@@ -2,7 +2,11 @@
 
 #include <algorithm>
 #include <cassert>
+#include <condition_variable>
+#include <cstdint>
 #include <limits>
+#include <mutex>
+#include <numeric>
 #include <vector>
 
 #include "bvh.hpp"
@@ -11,45 +15,154 @@
 namespace BVH
 {
 
-    void AABBTree::subdivide(Node *parent, float aabb_expansion)
+    // Bounds and centroid of a triangle, computed once before building
+    // so that splitting nodes never has to go back to the vertices.
+    // One struct per triangle rather than one array per component, partitioning swaps whole primitives
+    // and adds each to its side's stats as it passes, which with separate arrays touches nine of them per primitive
+    struct VariancePrimitive
     {
-        auto begin = parent->begin;
-        auto end = parent->end;
+        AABB aabb;
+        Vector4 centroid;
+    };
 
-        assert(begin < end);
+    // Bounding box and centroid moments of a range of primitives, all a node needs to pick its split
+    struct VarianceStats
+    {
+        AABB aabb = {Vector4(-std::numeric_limits<float>::max()), Vector4(std::numeric_limits<float>::max())};
+        Vector4 centroid_sum = Vector4(0.0f);
+        Vector4 centroid_sum_of_squares = Vector4(0.0f);
+        long count = 0;
+
+        void add(const VariancePrimitive &prim)
+        {
+            aabb.upper = aabb.upper.max(prim.aabb.upper);
+            aabb.lower = aabb.lower.min(prim.aabb.lower);
+            centroid_sum = centroid_sum + prim.centroid;
+            centroid_sum_of_squares = centroid_sum_of_squares + prim.centroid * prim.centroid;
+            count++;
+        }
+
+        void merge(const VarianceStats &other)
+        {
+            aabb.upper = aabb.upper.max(other.aabb.upper);
+            aabb.lower = aabb.lower.min(other.aabb.lower);
+            centroid_sum = centroid_sum + other.centroid_sum;
+            centroid_sum_of_squares = centroid_sum_of_squares + other.centroid_sum_of_squares;
+            count += other.count;
+        }
+    };
+
+    // Splits nodes at the centroid mean along the axis of largest centroid variance.
+    // Each partition sweep also accumulates the stats of both sides, so every level of the tree
+    // reads each primitive once, and triangles are only moved into leaf order after the last split
+    class VarianceBuilder
+    {
+    private:
+        // Nodes with fewer triangles than this are built to completion by the thread that split them off,
+        // larger ones go to the shared stack so that idle threads can pick them up
+        static constexpr long PARALLEL_BUILD_MIN_TRIS = 4096;
+        // Nodes with at least this many triangles are split one at a time before the worker threads start,
+        // with all threads partitioning the node, so that the top of the tree is not built by a single thread
+        static constexpr long PARALLEL_PARTITION_MIN_TRIS = 1 << 17;
+        static constexpr long PARTITION_BLOCK_SIZE = 1 << 14;
+
+        struct Task
+        {
+            Node *node;
+            int depth;
+            VarianceStats stats;
+        };
 
-        Vector4 &upper = parent->aabb.upper;
-        Vector4 &lower = parent->aabb.lower;
+        AABBTree &tree;
+        std::vector<VariancePrimitive> prims;
+        // Index into tree.tris of the triangle each primitive was made from, moved along with prims
+        std::vector<uint32_t> order;
+        // Destination of the parallel partition, only allocated for meshes that need it
+        std::vector<VariancePrimitive> scratch_prims;
+        std::vector<uint32_t> scratch_order;
 
-        lower = upper = begin->vertices[0];
+        VarianceStats calc_primitives();
+        bool split_node(const Task &task, Task *left, Task *right);
+        long partition(long begin, long end, int split_axis, float split_pos, VarianceStats *left,
+                       VarianceStats *right);
+        long partition_parallel(long begin, long end, int split_axis, float split_pos, VarianceStats *left,
+                                VarianceStats *right);
+        void apply_order();
 
-        // Calculate variance to determine split axis based on axis with the largest variance,
-        // this produces more balanced trees and overcomes an issue that happens with meshes that contain
-        // long thin triangles, where normal largest-bounding-box-split-axis fails.
-        // P.S.: we also calculate the node's bounding box in same loop while we are at it
-        Vector4 mean(0.0f);
-        Vector4 mean_of_squares(0.0f);
-        long num_tris = std::distance(begin, end);
-        assert(num_tris > 0);
-        for (auto it = begin; it != end; ++it)
+    public:
+        explicit VarianceBuilder(AABBTree &tree);
+
+        void build();
+    };
+
+    VarianceBuilder::VarianceBuilder(AABBTree &tree) : tree(tree)
+    {
+    }
+
+    VarianceStats VarianceBuilder::calc_primitives()
+    {
+        prims.resize(tree.tris.size());
+        order.resize(tree.tris.size());
+        std::iota(order.begin(), order.end(), 0);
+
+        // Stats are summed per fixed block and the blocks merged in index order, so that rounding, and with it
+        // every split position, does not depend on the number of threads
+        long num_prims = prims.size();
+        int num_blocks = static_cast<int>((num_prims + PARTITION_BLOCK_SIZE - 1) / PARTITION_BLOCK_SIZE);
+        std::vector<VarianceStats> block_stats(num_blocks);
+#pragma omp parallel for if (num_prims >= PARALLEL_BUILD_MIN_TRIS)
+        for (int block = 0; block < num_blocks; block++)
         {
-            for (auto vertex : it->vertices)
+            long block_begin = block * PARTITION_BLOCK_SIZE;
+            long block_end = std::min(block_begin + PARTITION_BLOCK_SIZE, num_prims);
+            for (long i = block_begin; i < block_end; i++)
             {
-                upper = upper.max(vertex);
-                lower = lower.min(vertex);
+                const Triangle &tri = tree.tris[i];
+                VariancePrimitive &prim = prims[i];
+                prim.aabb.upper = prim.aabb.lower = tri.vertices[0];
+                for (auto vertex : tri.vertices)
+                {
+                    prim.aabb.upper = prim.aabb.upper.max(vertex);
+                    prim.aabb.lower = prim.aabb.lower.min(vertex);
+                }
+                prim.centroid = (tri.vertices[0] + tri.vertices[1] + tri.vertices[2]) * (1.0f / 3.0f);
+                block_stats[block].add(prim);
             }
+        }
 
-            Vector4 triangle_center = it->calc_centroid();
-            mean = mean + triangle_center / num_tris;
-            mean_of_squares = mean_of_squares + (triangle_center * triangle_center) / num_tris;
+        VarianceStats stats;
+        for (const VarianceStats &block : block_stats)
+        {
+            stats.merge(block);
         }
-        Vector4 variance = mean_of_squares - mean * mean;
+        return stats;
+    }
+
+    // Sets the node's bounding box and splits it in two, returns false when it stays a leaf
+    bool VarianceBuilder::split_node(const Task &task, Task *left, Task *right)
+    {
+        Node *node = task.node;
+        const VarianceStats &stats = task.stats;
 
         // Set and expand bounding box by some value,
         // this helps increase the robustness of queries
         // (e.g. tangent rays or very thin bounding boxes)
-        upper = upper + Vector4(aabb_expansion);
-        lower = lower - Vector4(aabb_expansion);
+        node->aabb.upper = stats.aabb.upper + Vector4(tree.aabb_expansion);
+        node->aabb.lower = stats.aabb.lower - Vector4(tree.aabb_expansion);
+
+        // Coincident centroids can make every split peel off a single triangle,
+        // the cap keeps such meshes from producing arbitrarily deep trees
+        if ((stats.count == 1) || (task.depth >= tree.options.max_depth))
+        {
+            return false;
+        }
+
+        // Split axis is the axis with the largest variance, this produces more balanced trees and overcomes
+        // an issue that happens with meshes that contain long thin triangles,
+        // where normal largest-bounding-box-split-axis fails
+        float inv_count = 1.0f / stats.count;
+        Vector4 mean = stats.centroid_sum * inv_count;
+        Vector4 variance = stats.centroid_sum_of_squares * inv_count - mean * mean;
 
         int split_axis = 0;
 
@@ -65,22 +178,251 @@ namespace BVH
 
         float split_pos = mean[split_axis];
 
-        auto middle = std::partition(begin, end, [split_axis, split_pos](const Triangle &t)
-                                     { return t.calc_centroid()[split_axis] < split_pos; });
+        long begin = std::distance(tree.tris.begin(), node->begin);
+        long end = std::distance(tree.tris.begin(), node->end);
+        left->stats = VarianceStats();
+        right->stats = VarianceStats();
+        long middle = (end - begin >= PARALLEL_PARTITION_MIN_TRIS)
+                          ? partition_parallel(begin, end, split_axis, split_pos, &left->stats, &right->stats)
+                          : partition(begin, end, split_axis, split_pos, &left->stats, &right->stats);
 
         if ((middle == begin) || (middle == end))
         {
-            return;
+            return false;
+        }
+
+        node->left = tree.new_node(node->begin, tree.tris.begin() + middle);
+        node->right = tree.new_node(tree.tris.begin() + middle, node->end);
+        left->node = node->left;
+        right->node = node->right;
+        left->depth = right->depth = task.depth + 1;
+        return true;
+    }
+
+    // Works like std::partition on primitive centroids, swapping order along with prims,
+    // every primitive is added to the stats of the side it ends up on as the sweep passes it
+    long VarianceBuilder::partition(long begin, long end, int split_axis, float split_pos, VarianceStats *left,
+                                    VarianceStats *right)
+    {
+        auto is_left = [this, split_axis, split_pos](long i)
+        { return prims[i].centroid[split_axis] < split_pos; };
+
+        long first = begin;
+        long last = end;
+        while (true)
+        {
+            while ((first != last) && is_left(first))
+            {
+                left->add(prims[first]);
+                ++first;
+            }
+            if (first == last)
+            {
+                break;
+            }
+            --last;
+            while ((first != last) && !is_left(last))
+            {
+                right->add(prims[last]);
+                --last;
+            }
+            if (first == last)
+            {
+                // The scan from the left already stopped at this primitive, so it belongs to the right
+                right->add(prims[first]);
+                break;
+            }
+            std::swap(prims[first], prims[last]);
+            std::swap(order[first], order[last]);
+            left->add(prims[first]);
+            right->add(prims[last]);
+            ++first;
         }
+        return first;
+    }
 
-        Node *left = new_node(begin, middle);
-        Node *right = new_node(middle, end);
+    // Stable partition in two passes over fixed size blocks, the first counts each block's primitives on either side,
+    // the second scatters them to their final position in the scratch buffers, which are then copied back.
+    // Unlike the in-place sweep every pass runs on all threads, and results do not depend on the number of threads
+    long VarianceBuilder::partition_parallel(long begin, long end, int split_axis, float split_pos, VarianceStats *left,
+                                             VarianceStats *right)
+    {
+        auto is_left = [this, split_axis, split_pos](long i)
+        { return prims[i].centroid[split_axis] < split_pos; };
 
-        parent->left = left;
-        parent->right = right;
+        int num_blocks = static_cast<int>((end - begin + PARTITION_BLOCK_SIZE - 1) / PARTITION_BLOCK_SIZE);
+        std::vector<VarianceStats> block_left(num_blocks), block_right(num_blocks);
+#pragma omp parallel for
+        for (int block = 0; block < num_blocks; block++)
+        {
+            long block_begin = begin + block * PARTITION_BLOCK_SIZE;
+            long block_end = std::min(block_begin + PARTITION_BLOCK_SIZE, end);
+            for (long i = block_begin; i < block_end; i++)
+            {
+                if (is_left(i))
+                {
+                    block_left[block].add(prims[i]);
+                }
+                else
+                {
+                    block_right[block].add(prims[i]);
+                }
+            }
+        }
+
+        // Left primitives of each block go after those of the blocks before it, and likewise for right ones
+        std::vector<long> left_offsets(num_blocks), right_offsets(num_blocks);
+        for (int block = 0; block < num_blocks; block++)
+        {
+            left_offsets[block] = begin + left->count;
+            left->merge(block_left[block]);
+        }
+        long middle = begin + left->count;
+        for (int block = 0; block < num_blocks; block++)
+        {
+            right_offsets[block] = middle + right->count;
+            right->merge(block_right[block]);
+        }
+
+        if (scratch_prims.empty())
+        {
+            scratch_prims.resize(prims.size());
+            scratch_order.resize(order.size());
+        }
+#pragma omp parallel for
+        for (int block = 0; block < num_blocks; block++)
+        {
+            long block_begin = begin + block * PARTITION_BLOCK_SIZE;
+            long block_end = std::min(block_begin + PARTITION_BLOCK_SIZE, end);
+            long next_left = left_offsets[block];
+            long next_right = right_offsets[block];
+            for (long i = block_begin; i < block_end; i++)
+            {
+                long dst = is_left(i) ? next_left++ : next_right++;
+                scratch_prims[dst] = prims[i];
+                scratch_order[dst] = order[i];
+            }
+        }
+
+#pragma omp parallel for
+        for (int i = (int)begin; i < (int)end; i++)
+        {
+            prims[i] = scratch_prims[i];
+            order[i] = scratch_order[i];
+        }
+        return middle;
+    }
+
+    // Moves triangles, and their input indices, into the order leaves reference them in
+    void VarianceBuilder::apply_order()
+    {
+        std::vector<Triangle> tris = tree.tris;
+        std::vector<uint32_t> tri_indices = tree.tri_indices;
+#pragma omp parallel for if (order.size() >= PARALLEL_BUILD_MIN_TRIS)
+        for (int i = 0; i < (int)order.size(); i++)
+        {
+            tree.tris[i] = tris[order[i]];
+            tree.tri_indices[i] = tri_indices[order[i]];
+        }
+    }
+
+    // Splits nodes from explicit stacks instead of recursing, so depth is only bounded by options.max_depth
+    void VarianceBuilder::build()
+    {
+        tree.root = tree.new_node(tree.tris.begin(), tree.tris.end());
+
+        std::vector<Task> shared_tasks;
+        std::vector<Task> large_tasks = {{tree.root, 0, calc_primitives()}};
+        while (!large_tasks.empty())
+        {
+            Task task = large_tasks.back();
+            large_tasks.pop_back();
+            Task children[2];
+            if (!split_node(task, &children[0], &children[1]))
+            {
+                continue;
+            }
+
+            for (const Task &child : children)
+            {
+                if (child.stats.count >= PARALLEL_PARTITION_MIN_TRIS)
+                {
+                    large_tasks.push_back(child);
+                }
+                else
+                {
+                    shared_tasks.push_back(child);
+                }
+            }
+        }
+        // Only needed by the top levels
+        scratch_prims = std::vector<VariancePrimitive>();
+        scratch_order = std::vector<uint32_t>();
+
+        // Threads holding a task, which may still push children to shared_tasks. Idle threads sleep until a task is
+        // shared or the last busy thread finishes, only then can there be nothing left to do
+        int num_busy_threads = 0;
+        std::mutex tasks_mutex;
+        std::condition_variable tasks_changed;
+#pragma omp parallel if (prims.size() >= PARALLEL_BUILD_MIN_TRIS)
+        {
+            std::vector<Task> tasks;
+            while (true)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(tasks_mutex);
+                    tasks_changed.wait(lock, [&]()
+                                       { return !shared_tasks.empty() || (num_busy_threads == 0); });
+                    if (shared_tasks.empty())
+                    {
+                        break;
+                    }
+                    tasks.push_back(shared_tasks.back());
+                    shared_tasks.pop_back();
+                    num_busy_threads++;
+                }
+
+                while (!tasks.empty())
+                {
+                    Task task = tasks.back();
+                    tasks.pop_back();
+                    Task children[2];
+                    if (!split_node(task, &children[0], &children[1]))
+                    {
+                        continue;
+                    }
+
+                    for (const Task &child : children)
+                    {
+                        if (child.stats.count >= PARALLEL_BUILD_MIN_TRIS)
+                        {
+                            {
+                                std::lock_guard<std::mutex> lock(tasks_mutex);
+                                shared_tasks.push_back(child);
+                            }
+                            tasks_changed.notify_one();
+                        }
+                        else
+                        {
+                            tasks.push_back(child);
+                        }
+                    }
+                }
+
+                bool is_done;
+                {
+                    std::lock_guard<std::mutex> lock(tasks_mutex);
+                    num_busy_threads--;
+                    is_done = (num_busy_threads == 0);
+                }
+                if (is_done)
+                {
+                    tasks_changed.notify_all();
+                }
+            }
+        }
 
-        subdivide(left, aabb_expansion);
-        subdivide(right, aabb_expansion);
+        apply_order();
     }
 
 }
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+
+#include "bvh.hpp"
+#include "non_copyable.hpp"
+#include "vec4.hpp"
+
+namespace BVH
+{
+
+    // Affine transform stored as three rows, w of each row holds the translation
+    struct Transform
+    {
+        Vector4 rows[3];
+
+        Transform()
+        {
+            rows[0] = Vector4(1, 0, 0, 0);
+            rows[1] = Vector4(0, 1, 0, 0);
+            rows[2] = Vector4(0, 0, 1, 0);
+        }
+
+        Transform(Vector4 row0, Vector4 row1, Vector4 row2)
+        {
+            rows[0] = row0;
+            rows[1] = row1;
+            rows[2] = row2;
+        }
+
+        static Transform translation(Vector4 offset)
+        {
+            return {Vector4(1, 0, 0, offset.x), Vector4(0, 1, 0, offset.y), Vector4(0, 0, 1, offset.z)};
+        }
+
+        static Transform scale(float factor)
+        {
+            return {Vector4(factor, 0, 0, 0), Vector4(0, factor, 0, 0), Vector4(0, 0, factor, 0)};
+        }
+
+        static Transform rotation_z(float angle)
+        {
+            float c = std::cos(angle);
+            float s = std::sin(angle);
+            return {Vector4(c, -s, 0, 0), Vector4(s, c, 0, 0), Vector4(0, 0, 1, 0)};
+        }
+
+        // Applies other first, then this
+        Transform operator*(const Transform &other) const
+        {
+            Transform result;
+            for (int i = 0; i < 3; i++)
+            {
+                for (int j = 0; j < 4; j++)
+                {
+                    float value = (j == 3) ? rows[i][3] : 0.0f;
+                    for (int k = 0; k < 3; k++)
+                    {
+                        value += rows[i][k] * other.rows[k][j];
+                    }
+                    result.rows[i][j] = value;
+                }
+            }
+            return result;
+        }
+
+        Vector4 transform_point(Vector4 point) const
+        {
+            return {rows[0].dot3(point) + rows[0].w, rows[1].dot3(point) + rows[1].w, rows[2].dot3(point) + rows[2].w};
+        }
+
+        Vector4 transform_vector(Vector4 vector) const
+        {
+            return {rows[0].dot3(vector), rows[1].dot3(vector), rows[2].dot3(vector)};
+        }
+
+        // Bounds of the transformed box, using the center/extent formulation (Arvo, Graphics Gems 1990)
+        AABB transform_aabb(const AABB &aabb) const
+        {
+            Vector4 center = transform_point((aabb.upper + aabb.lower) * 0.5f);
+            Vector4 half_extent = (aabb.upper - aabb.lower) * 0.5f;
+            Vector4 new_half_extent;
+            for (int i = 0; i < 3; i++)
+            {
+                new_half_extent[i] = std::abs(rows[i].x) * half_extent.x +
+                                     std::abs(rows[i].y) * half_extent.y +
+                                     std::abs(rows[i].z) * half_extent.z;
+            }
+            AABB result;
+            result.upper = center + new_half_extent;
+            result.lower = center - new_half_extent;
+            return result;
+        }
+
+        Transform inverse() const
+        {
+            // Inverse of the 3x3 part from the adjugate, translation is then negated and rotated back
+            Vector4 c0(rows[0].x, rows[1].x, rows[2].x);
+            Vector4 c1(rows[0].y, rows[1].y, rows[2].y);
+            Vector4 c2(rows[0].z, rows[1].z, rows[2].z);
+            Vector4 r0 = c1.cross3(c2);
+            Vector4 r1 = c2.cross3(c0);
+            Vector4 r2 = c0.cross3(c1);
+            float inv_det = 1.0f / c0.dot3(r0);
+            r0 = r0 * inv_det;
+            r1 = r1 * inv_det;
+            r2 = r2 * inv_det;
+
+            Vector4 t(rows[0].w, rows[1].w, rows[2].w);
+            r0.w = -r0.dot3(t);
+            r1.w = -r1.dot3(t);
+            r2.w = -r2.dot3(t);
+            return {r0, r1, r2};
+        }
+    };
+
+    struct TopLevelNode
+    {
+        AABB aabb;
+        int left = -1, right = -1;
+        // Leaves reference instances [first, first + count) of the instance order array
+        int first = 0, count = 0;
+
+        bool is_leaf() const
+        {
+            return left == -1;
+        }
+    };
+
+    // Top level acceleration structure over instances of bottom level AABBTrees,
+    // each instance places a shared tree in the world with an affine transform,
+    // rays are transformed into instance space instead of transforming triangles
+    class TopLevelAABBTree : public NonCopyable
+    {
+    private:
+        std::vector<const AABBTree *> instance_trees;
+        std::vector<Transform> transforms;
+        std::vector<Transform> inverse_transforms;
+        std::vector<AABB> instance_aabbs;
+        std::vector<int> instance_order;
+        std::vector<TopLevelNode> nodes;
+
+        int build_node(int first, int count);
+
+    public:
+        // tree is referenced, not copied, and must outlive this
+        int add_instance(const AABBTree &tree, const Transform &transform);
+
+        void set_instance_transform(int instance, const Transform &transform);
+
+        // (Re)builds the top level nodes, must be called after adding instances or changing transforms
+        // and before tracing, this only touches instance bounds so it is cheap compared to building the meshes
+        void build();
+
+        bool does_intersect_ray(Vector4 origin, Vector4 direction, float *t_out) const;
+
+        void print_stats() const;
+    };
+
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+
+namespace BVH
+{
+
+    // Work done by ray queries, only collected when built with BVH_TRAVERSAL_COUNTERS defined,
+    // otherwise the counting macros below compile to nothing and all counters stay zero
+    struct TraversalCounters
+    {
+        uint64_t num_rays = 0;
+        // Nodes whose box was hit and whose children or triangles were then processed
+        uint64_t nodes_visited = 0;
+        uint64_t boxes_tested = 0;
+        uint64_t triangles_tested = 0;
+        // Deepest traversal stack (or recursion) depth reached by any query
+        uint32_t max_stack_depth = 0;
+
+        void merge(const TraversalCounters &other)
+        {
+            num_rays += other.num_rays;
+            nodes_visited += other.nodes_visited;
+            boxes_tested += other.boxes_tested;
+            triangles_tested += other.triangles_tested;
+            max_stack_depth = std::max(max_stack_depth, other.max_stack_depth);
+        }
+    };
+
+    // Counters are kept per thread so that queries never contend on them,
+    // these return and reset the calling thread's counters, which accumulate across queries until reset,
+    // a per query count is obtained by resetting before the query and reading right after it
+    TraversalCounters get_traversal_counters();
+
+    void reset_traversal_counters();
+
+#ifdef BVH_TRAVERSAL_COUNTERS
+    extern thread_local TraversalCounters thread_traversal_counters;
+    extern thread_local uint32_t thread_stack_depth;
+
+#define BVH_COUNT(counter) (BVH::thread_traversal_counters.counter++)
+#define BVH_COUNT_ADD(counter, n) (BVH::thread_traversal_counters.counter += (n))
+#define BVH_COUNT_PUSH()                                                  \
+    (BVH::thread_traversal_counters.max_stack_depth =                      \
+         std::max(BVH::thread_traversal_counters.max_stack_depth, ++BVH::thread_stack_depth))
+#define BVH_COUNT_POP() (BVH::thread_stack_depth--)
+#else
+#define BVH_COUNT(counter) ((void)0)
+#define BVH_COUNT_ADD(counter, n) ((void)0)
+#define BVH_COUNT_PUSH() ((void)0)
+#define BVH_COUNT_POP() ((void)0)
+#endif
+
+}
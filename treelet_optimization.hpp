@@ -0,0 +1,228 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "bvh.hpp"
+#include "utils.hpp"
+#include "vec4.hpp"
+
+namespace BVH
+{
+
+    // Treelet restructuring, see "Fast Parallel Construction of High-Quality Bounding Volume Hierarchies"
+    // (Karras and Aila 2013). A treelet is a node plus descendants expanded largest area first until it has
+    // MAX_TREELET_LEAVES leaves, the optimal binary tree over those leaves, by SAH, is found by dynamic programming
+    // over all subsets of them and replaces the treelet's inner nodes when it is cheaper. Works on any built tree
+    class TreeletOptimizer
+    {
+    private:
+        static constexpr int MAX_TREELET_LEAVES = 7;
+        static constexpr int NUM_SUBSETS = 1 << MAX_TREELET_LEAVES;
+        // Treelet leaves are at most MAX_TREELET_LEAVES - 1 levels below the root, so treelets rooted at depths
+        // equal modulo this never share nodes and can be optimized in parallel
+        static constexpr int TREELET_HEIGHT = MAX_TREELET_LEAVES;
+        // Relative SAH improvement a treelet needs before it is rewritten, keeps rounding noise from churning nodes
+        static constexpr float MIN_IMPROVEMENT = 1e-4f;
+
+        AABBTree &tree;
+
+        std::vector<Node *> collect_roots(int depth_offset) const;
+        bool optimize_treelet(Node *root) const;
+
+    public:
+        explicit TreeletOptimizer(AABBTree &tree);
+
+        // Returns the number of treelets that were rewritten
+        size_t optimize(int num_passes, float time_budget_ms);
+    };
+
+    TreeletOptimizer::TreeletOptimizer(AABBTree &tree) : tree(tree)
+    {
+    }
+
+    // Inner nodes at depths equal to depth_offset modulo TREELET_HEIGHT
+    std::vector<Node *> TreeletOptimizer::collect_roots(int depth_offset) const
+    {
+        std::vector<Node *> roots;
+        std::vector<std::pair<Node *, int>> stack = {{tree.root, 0}};
+        while (!stack.empty())
+        {
+            Node *node = stack.back().first;
+            int depth = stack.back().second;
+            stack.pop_back();
+            if (node->is_leaf())
+            {
+                continue;
+            }
+            if (depth % TREELET_HEIGHT == depth_offset)
+            {
+                roots.push_back(node);
+            }
+            stack.push_back({node->left, depth + 1});
+            stack.push_back({node->right, depth + 1});
+        }
+        return roots;
+    }
+
+    bool TreeletOptimizer::optimize_treelet(Node *root) const
+    {
+        // Grow the treelet by replacing its largest leaf with that leaf's children,
+        // tree leaves cannot be expanded and stay treelet leaves
+        Node *leaves[MAX_TREELET_LEAVES] = {root->left, root->right};
+        Node *inner_nodes[MAX_TREELET_LEAVES - 1] = {root};
+        int num_leaves = 2;
+        int num_inner_nodes = 1;
+        // The root keeps its bounds whatever the topology below it, so its area is left out of both costs
+        float old_cost = 0.0f;
+        while (num_leaves < MAX_TREELET_LEAVES)
+        {
+            int largest = -1;
+            float largest_area = -1.0f;
+            for (int i = 0; i < num_leaves; i++)
+            {
+                float area = calc_surface_area(leaves[i]->aabb);
+                if (!leaves[i]->is_leaf() && (area > largest_area))
+                {
+                    largest = i;
+                    largest_area = area;
+                }
+            }
+            if (largest == -1)
+            {
+                break;
+            }
+
+            Node *node = leaves[largest];
+            inner_nodes[num_inner_nodes++] = node;
+            old_cost += largest_area;
+            leaves[largest] = node->left;
+            leaves[num_leaves++] = node->right;
+        }
+        if (num_leaves < 3)
+        {
+            return false;
+        }
+
+        // Leaf subtrees cost the same in every topology, so only the areas of inner nodes are compared
+        int num_subsets = 1 << num_leaves;
+        AABB subset_aabbs[NUM_SUBSETS];
+        float costs[NUM_SUBSETS];
+        uint8_t best_splits[NUM_SUBSETS];
+        for (int subset = 1; subset < num_subsets; subset++)
+        {
+            int lowest = 0;
+            while (!(subset & (1 << lowest)))
+            {
+                lowest++;
+            }
+            int rest = subset & (subset - 1);
+            subset_aabbs[subset] = (rest == 0) ? leaves[lowest]->aabb : merge_aabbs(leaves[lowest]->aabb, subset_aabbs[rest]);
+            if (rest == 0)
+            {
+                costs[subset] = 0.0f;
+                continue;
+            }
+
+            // Only splits where the left side holds the lowest leaf, so that each split is tried once
+            float best_cost = std::numeric_limits<float>::max();
+            int best_split = 0;
+            for (int left = (subset - 1) & subset; left != 0; left = (left - 1) & subset)
+            {
+                if (!(left & (1 << lowest)))
+                {
+                    continue;
+                }
+                float cost = costs[left] + costs[subset ^ left];
+                if (cost < best_cost)
+                {
+                    best_cost = cost;
+                    best_split = left;
+                }
+            }
+            costs[subset] = calc_surface_area(subset_aabbs[subset]) + best_cost;
+            best_splits[subset] = static_cast<uint8_t>(best_split);
+        }
+
+        int all_leaves = num_subsets - 1;
+        float new_cost = costs[all_leaves] - calc_surface_area(subset_aabbs[all_leaves]);
+        if (new_cost >= old_cost * (1.0f - MIN_IMPROVEMENT))
+        {
+            return false;
+        }
+
+        // Rebuild top-down reusing the treelet's inner nodes. Treelets optimized at the same time never share nodes,
+        // the root keeps its place and bounds since it covers the same leaves whatever the topology below it,
+        // and it may only be rewritten as part of its parent's treelet, which is optimized in a different round
+        struct Item
+        {
+            Node *node;
+            int subset;
+        };
+        Item stack[MAX_TREELET_LEAVES];
+        int stack_size = 0;
+        int next_inner_node = 1;
+        stack[stack_size++] = {root, all_leaves};
+        while (stack_size > 0)
+        {
+            Item item = stack[--stack_size];
+            int sides[2] = {best_splits[item.subset], item.subset ^ best_splits[item.subset]};
+            Node *children[2];
+            for (int i = 0; i < 2; i++)
+            {
+                if ((sides[i] & (sides[i] - 1)) == 0)
+                {
+                    int leaf = 0;
+                    while (sides[i] != (1 << leaf))
+                    {
+                        leaf++;
+                    }
+                    children[i] = leaves[leaf];
+                }
+                else
+                {
+                    children[i] = inner_nodes[next_inner_node++];
+                    stack[stack_size++] = {children[i], sides[i]};
+                }
+            }
+            item.node->left = children[0];
+            item.node->right = children[1];
+            if (item.node != root)
+            {
+                item.node->aabb = subset_aabbs[item.subset];
+            }
+        }
+        return true;
+    }
+
+    size_t TreeletOptimizer::optimize(int num_passes, float time_budget_ms)
+    {
+        auto start = std::chrono::steady_clock::now();
+        size_t num_rewritten = 0;
+        for (int pass = 0; pass < num_passes; pass++)
+        {
+            for (int depth_offset = 0; depth_offset < TREELET_HEIGHT; depth_offset++)
+            {
+                std::chrono::duration<float, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+                if ((time_budget_ms > 0.0f) && (elapsed.count() > time_budget_ms))
+                {
+                    return num_rewritten;
+                }
+
+                std::vector<Node *> roots = collect_roots(depth_offset);
+                int num_rewritten_now = 0;
+#pragma omp parallel for schedule(dynamic, 64) reduction(+ : num_rewritten_now)
+                for (int i = 0; i < (int)roots.size(); i++)
+                {
+                    num_rewritten_now += optimize_treelet(roots[i]);
+                }
+                num_rewritten += num_rewritten_now;
+            }
+        }
+        return num_rewritten;
+    }
+
+}
@@ -57,6 +57,47 @@ namespace BVH
         }
     }
 
+    float calc_surface_area(const AABB &aabb)
+    {
+        Vector4 d = aabb.upper - aabb.lower;
+        return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+
+    AABB merge_aabbs(const AABB &a, const AABB &b)
+    {
+        AABB result;
+        result.upper = a.upper.max(b.upper);
+        result.lower = a.lower.min(b.lower);
+        return result;
+    }
+
+    float sum_sah_areas(Node *node)
+    {
+        if (node == nullptr)
+        {
+            return 0.0f;
+        }
+        else if (node->is_leaf())
+        {
+            return calc_surface_area(node->aabb) * std::distance(node->begin, node->end);
+        }
+        else
+        {
+            return calc_surface_area(node->aabb) + sum_sah_areas(node->left) + sum_sah_areas(node->right);
+        }
+    }
+
+    // Surface area heuristic cost of the tree, using unit cost for both node traversal and triangle intersection
+    float calc_sah_cost(Node *root)
+    {
+        float root_area = calc_surface_area(root->aabb);
+        if (root_area <= 0.0f)
+        {
+            return 0.0f;
+        }
+        return sum_sah_areas(root) / root_area;
+    }
+
     bool is_point_above_plane(const Vector4 &point, const Vector4 &plane_normal, const Vector4 &plane_point)
     {
         return plane_normal.dot3(point - plane_point) > 0;
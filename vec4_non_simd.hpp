@@ -104,6 +104,11 @@ union Vector4
     {
         return arr[i];
     }
+
+    float operator[](size_t i) const
+    {
+        return arr[i];
+    }
 };
 
 static Vector4 operator/(const float &rhs, const Vector4 &lhs)